@@ -0,0 +1,377 @@
+/* Queues of elements shared between threads */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The harness allocator is not thread-safe, so use regular malloc/free */
+#define INTERNAL 1
+#include "cqueue.h"
+
+/* Hazard pointers each thread holds at once while operating on a queue */
+#define LFQ_HAZARDS 2
+
+/* One hazard pointer record for each thread operating on a queue at a time */
+#define LFQ_RECORDS LFQ_MAX_THREADS
+
+/* Length of a retired list that triggers a reclamation scan */
+#define LFQ_SCAN (2 * LFQ_HAZARDS * LFQ_RECORDS)
+
+#define CACHE_LINE 64
+
+/**
+ * hp_record_t - Hazard pointers of the thread currently owning the record
+ * @hp: nodes the owner may still dereference, which must not be freed
+ * @active: whether a thread owns the record
+ * @retired: nodes the owners of the record unlinked, chained through their
+ *           list.prev, waiting until no hazard pointer refers to them
+ * @nretired: length of @retired
+ *
+ * A thread claims a record for the length of one operation. The retired list
+ * stays with the record, so whichever thread claims it next carries on
+ * reclaiming it.
+ */
+typedef struct {
+    struct list_head *hp[LFQ_HAZARDS];
+    bool active;
+    struct list_head *retired;
+    size_t nretired;
+} __attribute__((aligned(CACHE_LINE))) hp_record_t;
+
+/**
+ * struct lfq - Michael-Scott queue
+ * @head: dummy node, whose successor is the first element
+ * @tail: last node, or one lagging behind it while an insertion completes
+ * @rec: hazard pointer records of the threads operating on the queue
+ *
+ * Nodes are the list members of elements, but only list.next is used as the
+ * link to the successor, NULL at the tail. It is always read and written
+ * atomically. The head and the tail sit on lines of their own, so producers
+ * and consumers do not invalidate each other's cache.
+ */
+struct lfq {
+    struct list_head *head __attribute__((aligned(CACHE_LINE)));
+    struct list_head *tail __attribute__((aligned(CACHE_LINE)));
+    hp_record_t rec[LFQ_RECORDS];
+};
+
+/* Record the calling thread claimed last, tried first next time */
+static __thread unsigned int hp_hint;
+
+static element_t *element_new(const char *s)
+{
+    size_t len = s ? strlen(s) + 1 : 1;
+    element_t *e = malloc(sizeof(element_t) + len);
+    if (!e)
+        return NULL;
+    e->value = e->data;
+    memcpy(e->data, s ? s : "", len);
+    e->list.next = NULL;
+    e->list.prev = NULL;
+    e->prefix = element_prefix(e->value);
+    e->slab = NULL;
+    return e;
+}
+
+static void element_delete(struct list_head *node)
+{
+    free(list_entry(node, element_t, list));
+}
+
+/* Copy the string of @node to @sp the way q_remove_head() does */
+static void element_copy(struct list_head *node, char *sp, size_t bufsize)
+{
+    if (!sp || !bufsize)
+        return;
+    const char *value = list_entry(node, element_t, list)->value;
+    size_t sz = strnlen(value, bufsize - 1);
+    memcpy(sp, value, sz);
+    sp[sz] = '\0';
+}
+
+static hp_record_t *hp_acquire(lfq_t *q)
+{
+    for (unsigned int i = hp_hint;; i = (i + 1) % LFQ_RECORDS) {
+        hp_record_t *r = &q->rec[i];
+        bool idle = false;
+        if (!__atomic_load_n(&r->active, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&r->active, &idle, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            hp_hint = i;
+            return r;
+        }
+    }
+}
+
+static void hp_release(hp_record_t *r)
+{
+    for (int i = 0; i < LFQ_HAZARDS; i++)
+        __atomic_store_n(&r->hp[i], NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->active, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Load *@src into hazard pointer @i of @r. The pointer is published before
+ * *@src is read again, so once both reads agree, any thread unlinking the
+ * node afterwards is bound to see the hazard pointer in its scan.
+ */
+static struct list_head *hp_protect(hp_record_t *r,
+                                    int i,
+                                    struct list_head **src)
+{
+    struct list_head *p = __atomic_load_n(src, __ATOMIC_ACQUIRE);
+    for (;;) {
+        __atomic_store_n(&r->hp[i], p, __ATOMIC_SEQ_CST);
+        struct list_head *again = __atomic_load_n(src, __ATOMIC_SEQ_CST);
+        if (again == p)
+            return p;
+        p = again;
+    }
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the nodes retired in @r that no hazard pointer refers to */
+static void hp_scan(lfq_t *q, hp_record_t *r)
+{
+    struct list_head *hazards[LFQ_RECORDS * LFQ_HAZARDS];
+    size_t n = 0;
+    for (int i = 0; i < LFQ_RECORDS; i++) {
+        for (int j = 0; j < LFQ_HAZARDS; j++) {
+            struct list_head *p =
+                __atomic_load_n(&q->rec[i].hp[j], __ATOMIC_SEQ_CST);
+            if (p)
+                hazards[n++] = p;
+        }
+    }
+    qsort(hazards, n, sizeof(*hazards), ptr_cmp);
+
+    struct list_head *keep = NULL;
+    size_t kept = 0;
+    for (struct list_head *node = r->retired, *prev; node; node = prev) {
+        prev = node->prev;
+        if (bsearch(&node, hazards, n, sizeof(*hazards), ptr_cmp)) {
+            node->prev = keep;
+            keep = node;
+            kept++;
+        } else {
+            element_delete(node);
+        }
+    }
+    r->retired = keep;
+    r->nretired = kept;
+}
+
+static void hp_retire(lfq_t *q, hp_record_t *r, struct list_head *node)
+{
+    node->prev = r->retired;
+    r->retired = node;
+    if (++r->nretired >= LFQ_SCAN)
+        hp_scan(q, r);
+}
+
+lfq_t *lfq_new(void)
+{
+    lfq_t *q = aligned_alloc(CACHE_LINE, sizeof(lfq_t));
+    element_t *dummy = element_new(NULL);
+    if (!q || !dummy) {
+        free(q);
+        free(dummy);
+        return NULL;
+    }
+    memset(q, 0, sizeof(*q));
+    q->head = q->tail = &dummy->list;
+    return q;
+}
+
+void lfq_free(lfq_t *q)
+{
+    if (!q)
+        return;
+
+    for (struct list_head *node = q->head, *next; node; node = next) {
+        next = node->next;
+        element_delete(node);
+    }
+    for (int i = 0; i < LFQ_RECORDS; i++) {
+        for (struct list_head *node = q->rec[i].retired, *prev; node;
+             node = prev) {
+            prev = node->prev;
+            element_delete(node);
+        }
+    }
+    free(q);
+}
+
+bool lfq_insert_tail(lfq_t *q, const char *s)
+{
+    if (!q)
+        return false;
+
+    element_t *e = element_new(s);
+    if (!e)
+        return false;
+
+    struct list_head *node = &e->list;
+    hp_record_t *r = hp_acquire(q);
+    for (;;) {
+        struct list_head *tail = hp_protect(r, 0, &q->tail);
+        struct list_head *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (tail != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+            continue;
+
+        // Help an insertion that linked its node but did not move the tail
+        if (next) {
+            __atomic_compare_exchange_n(&q->tail, &tail, next, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&tail->next, &next, node, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            __atomic_compare_exchange_n(&q->tail, &tail, node, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    hp_release(r);
+    return true;
+}
+
+bool lfq_remove_head(lfq_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return false;
+
+    hp_record_t *r = hp_acquire(q);
+    struct list_head *head, *next;
+    for (;;) {
+        head = hp_protect(r, 0, &q->head);
+        struct list_head *tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        next = hp_protect(r, 1, &head->next);
+        if (head != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+            continue;
+
+        if (!next) {
+            hp_release(r);
+            return false;
+        }
+
+        // Never let the head pass the tail
+        if (head == tail) {
+            __atomic_compare_exchange_n(&q->tail, &tail, next, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&q->head, &head, next, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    /* The successor becomes the dummy node, but its string is left for the
+     * winner of the exchange to copy, and hazard pointer 1 keeps it from
+     * being reclaimed in the meantime.
+     */
+    element_copy(next, sp, bufsize);
+    hp_retire(q, r, head);
+    hp_release(r);
+    return true;
+}
+
+/**
+ * struct tlq - Michael-Scott two-lock queue
+ * @head: dummy node, whose successor is the first element
+ * @tail: last node
+ * @head_lock: lock held to move @head
+ * @tail_lock: lock held to link a node after @tail, which is @head_lock
+ *             itself for a queue behind a single lock
+ * @locks: storage for the locks
+ *
+ * Nodes are linked through list.next as in struct lfq. The dummy node keeps
+ * insertions and removals from touching the same node, so with two locks a
+ * producer and a consumer never wait for each other. Only the link from the
+ * dummy node of an empty queue is shared by both ends, and it is accessed
+ * atomically.
+ */
+struct tlq {
+    struct list_head *head __attribute__((aligned(CACHE_LINE)));
+    pthread_mutex_t *head_lock;
+    struct list_head *tail __attribute__((aligned(CACHE_LINE)));
+    pthread_mutex_t *tail_lock;
+    pthread_mutex_t locks[2] __attribute__((aligned(CACHE_LINE)));
+};
+
+tlq_t *tlq_new(bool single_lock)
+{
+    tlq_t *q = aligned_alloc(CACHE_LINE, sizeof(tlq_t));
+    element_t *dummy = element_new(NULL);
+    if (!q || !dummy) {
+        free(q);
+        free(dummy);
+        return NULL;
+    }
+    q->head = q->tail = &dummy->list;
+    pthread_mutex_init(&q->locks[0], NULL);
+    pthread_mutex_init(&q->locks[1], NULL);
+    q->head_lock = &q->locks[0];
+    q->tail_lock = &q->locks[single_lock ? 0 : 1];
+    return q;
+}
+
+void tlq_free(tlq_t *q)
+{
+    if (!q)
+        return;
+
+    for (struct list_head *node = q->head, *next; node; node = next) {
+        next = node->next;
+        element_delete(node);
+    }
+    pthread_mutex_destroy(&q->locks[0]);
+    pthread_mutex_destroy(&q->locks[1]);
+    free(q);
+}
+
+bool tlq_insert_tail(tlq_t *q, const char *s)
+{
+    if (!q)
+        return false;
+
+    element_t *e = element_new(s);
+    if (!e)
+        return false;
+
+    pthread_mutex_lock(q->tail_lock);
+    __atomic_store_n(&q->tail->next, &e->list, __ATOMIC_RELEASE);
+    q->tail = &e->list;
+    pthread_mutex_unlock(q->tail_lock);
+    return true;
+}
+
+bool tlq_remove_head(tlq_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return false;
+
+    pthread_mutex_lock(q->head_lock);
+    struct list_head *head = q->head;
+    struct list_head *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        pthread_mutex_unlock(q->head_lock);
+        return false;
+    }
+    element_copy(next, sp, bufsize);
+    q->head = next;
+    pthread_mutex_unlock(q->head_lock);
+
+    // No other thread can reach the old dummy node anymore
+    element_delete(head);
+    return true;
+}
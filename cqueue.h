@@ -0,0 +1,102 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/* Queues of elements shared between threads.
+ *
+ * They hold the same element_t as the queue in queue.c, but allocate them
+ * with the C library directly: the harness keeps its bookkeeping in plain
+ * globals and cannot be called from several threads at once.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+/* Most threads that may operate on one lock-free queue at the same time. Any
+ * more busy-wait until one of them finishes its operation. */
+#define LFQ_MAX_THREADS 64
+
+/* Lock-free multi-producer/multi-consumer queue */
+typedef struct lfq lfq_t;
+
+/**
+ * lfq_new() - Create an empty lock-free queue
+ *
+ * Return: NULL for allocation failed.
+ */
+lfq_t *lfq_new(void);
+
+/**
+ * lfq_free() - Free all storage used by a lock-free queue
+ * @q: queue to be deleted
+ *
+ * No other thread may be using @q.
+ */
+void lfq_free(lfq_t *q);
+
+/**
+ * lfq_insert_tail() - Insert an element at the tail, from any thread
+ * @q: queue to insert into
+ * @s: string to be copied and inserted
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool lfq_insert_tail(lfq_t *q, const char *s);
+
+/**
+ * lfq_remove_head() - Remove the element at the head, from any thread
+ * @q: queue to remove from
+ * @sp: string to which the removed string is copied, or NULL
+ * @bufsize: size of the string
+ *
+ * Unlike q_remove_head(), the element itself is not handed over, since other
+ * threads may still be reading it: up to @bufsize - 1 characters of its
+ * string are copied to @sp, which is then null-terminated, and the element is
+ * reclaimed once no thread refers to it anymore.
+ *
+ * Return: true if an element was removed, false if queue is NULL or empty.
+ */
+bool lfq_remove_head(lfq_t *q, char *sp, size_t bufsize);
+
+/* Queue with one lock for each end, or a single lock for both */
+typedef struct tlq tlq_t;
+
+/**
+ * tlq_new() - Create an empty locked queue
+ * @single_lock: whether insertions and removals share one lock
+ *
+ * Return: NULL for allocation failed.
+ */
+tlq_t *tlq_new(bool single_lock);
+
+/**
+ * tlq_free() - Free all storage used by a locked queue
+ * @q: queue to be deleted
+ *
+ * No other thread may be using @q.
+ */
+void tlq_free(tlq_t *q);
+
+/**
+ * tlq_insert_tail() - Insert an element at the tail, from any thread
+ * @q: queue to insert into
+ * @s: string to be copied and inserted
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool tlq_insert_tail(tlq_t *q, const char *s);
+
+/**
+ * tlq_remove_head() - Remove the element at the head, from any thread
+ * @q: queue to remove from
+ * @sp: string to which the removed string is copied, or NULL
+ * @bufsize: size of the string
+ *
+ * The string is copied as by lfq_remove_head(), and the element is freed.
+ *
+ * Return: true if an element was removed, false if queue is NULL or empty.
+ */
+bool tlq_remove_head(tlq_t *q, char *sp, size_t bufsize);
+
+#endif /* LAB0_CQUEUE_H */
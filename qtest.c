@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -45,6 +48,7 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -67,6 +71,9 @@ typedef struct {
 static queue_chain_t chain = {.size = 0};
 static queue_contex_t *current = NULL;
 
+/* Priority queue used by the pq_* commands, created by the first pq_push */
+static pqueue_t *pq = NULL;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
 static int fail_count = 0;
@@ -77,6 +84,17 @@ static int descend = 0;
 
 int prng = 0;
 
+int sortalgo = SORT_MERGE;
+int sort_threads = 1;
+int sort_parallel_size = 1 << 16;
+int dedup_mode = 0;
+int pool_cap = 1024;
+int arena_mode = 0;
+int shuffle_block = 0;
+int lazy_reverse = 0;
+int keep_graveyard = 0;
+int select_partition = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -129,7 +147,11 @@ static bool do_free(int argc, char *argv[])
 
     q_show(3);
 
-    size_t bcnt = allocation_check();
+    /* Pooled elements count as allocated blocks, and so do the priority queue
+     * and its elements, which live on without any queue */
+    if (!chain.size)
+        q_pool_trim(0);
+    size_t bcnt = allocation_check() - (pq ? (size_t) pq->size + 1 : 0);
     if (!chain.size && bcnt > 0) {
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
@@ -189,6 +211,68 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Return the node after @node in the order queue @head runs in */
+static inline struct list_head *queue_next(struct list_head *head,
+                                           struct list_head *node)
+{
+    return q_reversed(head) ? node->prev : node->next;
+}
+
+/* Return the node before @node in the order queue @head runs in */
+static inline struct list_head *queue_prev(struct list_head *head,
+                                           struct list_head *node)
+{
+    return q_reversed(head) ? node->next : node->prev;
+}
+
+/*
+ * Check the two elements a bulk insertion of @reps strings at @pos added last,
+ * the way queue_insert() checks the first two elements it inserts one by one.
+ */
+static bool check_bulk_insert(position_t pos, char **strs, int reps)
+{
+    struct list_head *q = current->q;
+    struct list_head *last =
+        pos == POS_TAIL ? queue_prev(q, q) : queue_next(q, q);
+    struct list_head *prev =
+        pos == POS_TAIL ? queue_prev(q, last) : queue_next(q, last);
+    char *last_value = list_entry(last, element_t, list)->value;
+    char *prev_value = list_entry(prev, element_t, list)->value;
+
+    if (!last_value || !prev_value) {
+        report(1, "ERROR: Failed to save copy of string in queue");
+        return false;
+    }
+    if (last_value == strs[reps - 1]) {
+        report(1,
+               "ERROR: Need to allocate and copy string for new queue element");
+        return false;
+    }
+    if (last_value == prev_value) {
+        report(1,
+               "ERROR: Need to allocate separate string for each queue "
+               "element");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Run a constant time test with the node pool emptied and disabled. Whether an
+ * insertion finds a pooled element depends on how many elements the previous
+ * measurement freed, which is exactly the kind of data dependent timing the
+ * test is looking for, but in the allocator rather than in the queue.
+ */
+static bool test_const(bool (*test)(void))
+{
+    int cap = pool_cap;
+    q_pool_trim(0);
+    pool_cap = 0;
+    bool ok = test();
+    pool_cap = cap;
+    return ok;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -197,8 +281,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok =
-            pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
+        bool ok = test_const(pos == POS_TAIL ? is_insert_tail_const
+                                             : is_insert_head_const);
         if (!ok) {
             report(1,
                    "ERROR: Probably not constant time or wrong implementation");
@@ -235,7 +319,41 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
-    if (current && exception_setup(true)) {
+    /* Repeated insertions go through the bulk API when their strings fit in
+     * memory, and fall back to one insertion at a time otherwise */
+    char **strs = NULL, *rand_bufs = NULL;
+    if (current && reps > 1) {
+        strs = malloc(reps * sizeof(char *));
+        if (need_rand && strs)
+            rand_bufs = malloc((size_t) reps * MAX_RANDSTR_LEN);
+        if (need_rand && !rand_bufs) {
+            free(strs);
+            strs = NULL;
+        }
+        for (int r = 0; strs && r < reps; r++) {
+            strs[r] = inserts;
+            if (need_rand) {
+                strs[r] = rand_bufs + (size_t) r * MAX_RANDSTR_LEN;
+                fill_rand_string(strs[r], MAX_RANDSTR_LEN);
+            }
+        }
+    }
+
+    /* A bulk insertion interrupted by an exception is not retried */
+    bool bulk = strs;
+    if (strs && exception_setup(true)) {
+        bulk = pos == POS_TAIL ? q_insert_tail_bulk(current->q, strs, reps)
+                               : q_insert_head_bulk(current->q, strs, reps);
+        if (bulk) {
+            current->size += reps;
+            ok = check_bulk_insert(pos, strs, reps) && !error_check();
+        }
+    }
+    exception_cancel();
+    free(strs);
+    free(rand_bufs);
+
+    if (current && !bulk && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
@@ -243,10 +361,10 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                                         : q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
+                element_t *entry = list_entry(
+                    pos == POS_TAIL ? queue_prev(current->q, current->q)
+                                    : queue_next(current->q, current->q),
+                    element_t, list);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
@@ -309,8 +427,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
+        bool ok = test_const(pos == POS_TAIL ? is_remove_tail_const
+                                             : is_remove_head_const);
         if (!ok) {
             report(1,
                    "ERROR: Probably not constant time or wrong implementation");
@@ -426,6 +544,142 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+/* Batch removal */
+static bool queue_remove_n(position_t pos, int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int n;
+    if (!get_int(argv[1], &n) || n < 1) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    LIST_HEAD(removed);
+    int count = 0;
+    if (current && exception_setup(true))
+        count = pos == POS_TAIL ? q_remove_tail_n(current->q, &removed, n)
+                                : q_remove_head_n(current->q, &removed, n);
+    exception_cancel();
+
+    bool ok = true;
+    int expected = current ? (current->size < n ? current->size : n) : 0;
+    int listed = 0;
+    element_t *item, *tmp;
+    // q_remove_head_n and q_remove_tail_n are not responsible for releasing
+    // nodes
+    list_for_each_entry_safe(item, tmp, &removed, list) {
+        list_del(&item->list);
+        q_release_element(item);
+        listed++;
+    }
+
+    if (count != expected || listed != count) {
+        report(1,
+               "ERROR: Removed %d elements, %d handed back, expected %d", count,
+               listed, expected);
+        ok = false;
+    } else {
+        report(2, "Removed %d elements from queue", count);
+    }
+    if (current)
+        current->size -= listed;
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static inline bool do_rhn(int argc, char *argv[])
+{
+    return queue_remove_n(POS_HEAD, argc, argv);
+}
+
+static inline bool do_rtn(int argc, char *argv[])
+{
+    return queue_remove_n(POS_TAIL, argc, argv);
+}
+
+static int cmp_copy(const void *a, const void *b)
+{
+    return strcmp((*(element_t *const *) a)->value,
+                  (*(element_t *const *) b)->value);
+}
+
+/*
+ * Check the queue after a dedup in hash mode against @l_copy, the queue as it
+ * was before: the queue must keep, in their original order, exactly the
+ * elements whose string appears once in @l_copy.
+ */
+static bool check_dedup_anywhere(struct list_head *l_copy)
+{
+    element_t *item;
+    size_t n = 0;
+    list_for_each_entry(item, l_copy, list)
+        n++;
+
+    element_t **sorted = malloc(n * sizeof(element_t *) + 1);
+    if (!sorted) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
+    }
+    size_t i = 0;
+    list_for_each_entry(item, l_copy, list)
+        sorted[i++] = item;
+    qsort(sorted, n, sizeof(element_t *), cmp_copy);
+
+    /* Number of strings appearing exactly once */
+    int unique = 0;
+    for (i = 0; i < n; i++) {
+        if ((i == 0 || strcmp(sorted[i - 1]->value, sorted[i]->value)) &&
+            (i + 1 == n || strcmp(sorted[i]->value, sorted[i + 1]->value)))
+            unique++;
+    }
+
+    bool ok = true;
+    int kept = 0;
+    struct list_head *l_tmp = l_copy->next;
+    element_t *cur;
+    list_for_each_entry(cur, current->q, list) {
+        /* Each kept string must be unique in the original queue... */
+        element_t **pos = bsearch(&cur, sorted, n, sizeof(element_t *),
+                                  cmp_copy);
+        if (!pos || (pos > sorted && !cmp_copy(pos - 1, pos)) ||
+            (pos + 1 < sorted + n && !cmp_copy(pos, pos + 1))) {
+            ok = false;
+            break;
+        }
+        /* ...and appear in the same order as before */
+        while (l_tmp != l_copy &&
+               strcmp(list_entry(l_tmp, element_t, list)->value, cur->value))
+            l_tmp = l_tmp->next;
+        if (l_tmp == l_copy) {
+            ok = false;
+            break;
+        }
+        l_tmp = l_tmp->next;
+        kept++;
+    }
+    free(sorted);
+
+    ok = ok && kept == unique;
+    if (!ok)
+        report(1,
+               "ERROR: Duplicate strings are in queue or distinct strings are "
+               "not in queue");
+    current->size = q_size(current->q);
+    return ok;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -485,6 +739,11 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    if (dedup_mode) {
+        ok = check_dedup_anywhere(&l_copy);
+        goto free_copy;
+    }
+
     struct list_head *l_tmp = current->q->next;
     bool is_this_dup = false;
     // Compare between new list and old one
@@ -512,6 +771,7 @@ static bool do_dedup(int argc, char *argv[])
                "ERROR: Duplicate strings are in queue or distinct strings are "
                "not in queue");
 
+free_copy:
     list_for_each_entry_safe(item, tmp, &l_copy, list) {
         free(item->value);
         free(item);
@@ -609,7 +869,10 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
+    /* The radix sort works on a scratch array, which it must release again */
+    bool scratch = sortalgo == SORT_RADIX;
+    size_t blocks = allocation_check();
+    set_noallocate_mode(!scratch);
 
 /* If the number of elements is too large, it may take a long time to check the
  * stability of the sort. So, MAX_NODES is used to limit the number of elements
@@ -618,9 +881,9 @@ bool do_sort(int argc, char *argv[])
     struct list_head *nodes[MAX_NODES];
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry(entry, current->q, list)
-            nodes[no++] = &entry->list;
+        for (struct list_head *cur_l = queue_next(current->q, current->q);
+             cur_l != current->q; cur_l = queue_next(current->q, cur_l))
+            nodes[no++] = cur_l;
     } else if (current && current->size > MAX_NODES)
         report(1,
                "Warning: Skip checking the stability of the sort because the "
@@ -633,13 +896,19 @@ bool do_sort(int argc, char *argv[])
     set_noallocate_mode(false);
 
     bool ok = true;
+    if (scratch && allocation_check() != blocks) {
+        report(1, "ERROR: Sorting changed the number of allocated blocks");
+        ok = false;
+    }
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        for (struct list_head *cur_l = queue_next(current->q, current->q);
+             cur_l != current->q && --cnt;
+             cur_l = queue_next(current->q, cur_l)) {
             /* Ensure each element in ascending/descending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item =
+                list_entry(queue_next(current->q, cur_l), element_t, list);
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
@@ -656,7 +925,7 @@ bool do_sort(int argc, char *argv[])
                 !strcmp(item->value, next_item->value)) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
+                    if (nodes[i] == queue_next(current->q, cur_l)) {
                         unstable = true;
                         break;
                     }
@@ -857,6 +1126,156 @@ static bool do_reverseK(int argc, char *argv[])
     return !error_check();
 }
 
+static bool do_flush(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    if (exception_setup(true))
+        q_flush(current->q);
+    exception_cancel();
+
+    q_show(3);
+    return !error_check();
+}
+
+/* Hash of the order of the nodes in queue @head, to tell whether it changed */
+static uint64_t queue_order_hash(struct list_head *head)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (struct list_head *cur = queue_next(head, head); cur != head;
+         cur = queue_next(head, cur))
+        h = (h ^ (uintptr_t) cur) * 1099511628211ULL;
+    return h;
+}
+
+static bool do_select(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling select on null queue");
+        return false;
+    }
+    error_check();
+
+    int k = (current->size - 1) / 2;
+    if (argc == 2 && !get_int(argv[1], &k)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+    if (k < 0 || k >= current->size) {
+        report(1, "Position %d is out of range for a queue of %d elements", k,
+               current->size);
+        return false;
+    }
+
+    /* The array of elements the search works on must be released again */
+    size_t blocks = allocation_check();
+    uint64_t order = select_partition ? 0 : queue_order_hash(current->q);
+    if (current->size > BIG_LIST_SIZE)
+        set_cautious_mode(false);
+
+    element_t *found = NULL;
+    if (exception_setup(true))
+        found = q_select(current->q, k, descend);
+    exception_cancel();
+    set_cautious_mode(true);
+
+    if (!found) {
+        report(1, "ERROR: No element found at position %d", k);
+        return false;
+    }
+    report(2, "Element %d in %s order: %s", k,
+           descend ? "descending" : "ascending", found->value);
+
+    bool ok = true;
+    if (allocation_check() != blocks) {
+        report(1, "ERROR: Selecting changed the number of allocated blocks");
+        ok = false;
+    }
+
+    /* At most k elements may come before the one found in the chosen order,
+     * and more than k up to it. With selectpart set, none ahead of position k
+     * in the queue may come after it, and none behind it before it. */
+    int before = 0, upto = 0, pos = 0;
+    uint64_t h = 14695981039346656037ULL;
+    for (struct list_head *cur_l = queue_next(current->q, current->q);
+         cur_l != current->q; cur_l = queue_next(current->q, cur_l), pos++) {
+        element_t *item = list_entry(cur_l, element_t, list);
+        int c = strcmp(item->value, found->value);
+        if (descend)
+            c = -c;
+        before += c < 0;
+        upto += c <= 0;
+        h = (h ^ (uintptr_t) cur_l) * 1099511628211ULL;
+        if (select_partition && ok &&
+            ((pos < k && c > 0) || (pos > k && c < 0) ||
+             (pos == k && item != found))) {
+            report(1, "ERROR: Queue is not partitioned around position %d",
+                   k);
+            ok = false;
+        }
+    }
+    if (pos != current->size) {
+        report(1, "ERROR: Selecting changed the size of queue");
+        ok = false;
+    } else if (!select_partition && h != order) {
+        report(1, "ERROR: Selecting changed the order of queue");
+        ok = false;
+    } else if (!(before <= k && k < upto)) {
+        report(1, "ERROR: %s is not at position %d in %s order", found->value,
+               k, descend ? "descending" : "ascending");
+        ok = false;
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_nth(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling nth on null queue");
+        return false;
+    }
+    error_check();
+
+    int k = (current->size - 1) / 2;
+    if (argc == 2 && !get_int(argv[1], &k)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+    if (k < 0 || k >= current->size) {
+        report(1, "Position %d is out of range for a queue of %d elements", k,
+               current->size);
+        return false;
+    }
+
+    struct list_head *cur_l = queue_next(current->q, current->q);
+    for (int i = 0; i < k; i++)
+        cur_l = queue_next(current->q, cur_l);
+    report(2, "Element %d of queue: %s", k,
+           list_entry(cur_l, element_t, list)->value);
+    return !error_check();
+}
+
 static bool do_merge(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -972,7 +1391,7 @@ static bool q_show(int vlevel)
     report_noreturn(vlevel, "l = [");
 
     struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    struct list_head *cur = queue_next(current->q, current->q);
 
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < current->size) {
@@ -986,7 +1405,7 @@ static bool q_show(int vlevel)
                 }
             }
             cnt++;
-            cur = cur->next;
+            cur = queue_next(current->q, cur);
             ok = ok && !error_check();
         }
     }
@@ -1012,6 +1431,525 @@ static bool q_show(int vlevel)
     return ok;
 }
 
+static void pq_show(int vlevel)
+{
+    if (!pq) {
+        report(vlevel, "pq = NULL");
+        return;
+    }
+    element_t *top = pq_peek(pq);
+    if (top)
+        report(vlevel, "pq size = %d, next = %s", pq->size, top->value);
+    else
+        report(vlevel, "pq size = 0");
+}
+
+static bool do_pq_push(int argc, char *argv[])
+{
+    char randstr_buf[MAX_RANDSTR_LEN];
+    int reps = 1;
+    bool ok = true;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    char *inserts = argv[1];
+    if (argc == 3) {
+        if (!get_int(argv[2], &reps) || reps < 1) {
+            report(1, "Invalid number of insertions '%s'", argv[2]);
+            return false;
+        }
+    }
+
+    bool need_rand = !strcmp(inserts, "RAND");
+    if (need_rand)
+        inserts = randstr_buf;
+
+    if (!pq) {
+        if (exception_setup(true))
+            pq = pq_new(descend);
+        exception_cancel();
+        if (!pq) {
+            report(1, "ERROR: Could not create priority queue");
+            return false;
+        }
+    } else if (pq->descend != (bool) descend) {
+        report(1,
+               "Warning: Priority queue keeps popping in %s order until "
+               "pq_free",
+               pq->descend ? "descending" : "ascending");
+    }
+
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (need_rand)
+                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            int size = pq->size;
+            if (!pq_push(pq, inserts)) {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", inserts);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           inserts, fail_count);
+                    ok = false;
+                }
+            } else if (pq->size != size + 1) {
+                report(1, "ERROR: Priority queue size not updated");
+                ok = false;
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    pq_show(3);
+    return ok;
+}
+
+/*
+ * Pop n elements, checking that each comes out no later than the next one
+ * in the order of the priority queue.
+ */
+static bool do_pq_pop(int argc, char *argv[])
+{
+    int reps = 1;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_int(argv[1], &reps) || reps < 1)) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    char *removes = malloc(string_length + 1);
+    char *last = malloc(string_length + 1);
+    if (!removes || !last) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        free(removes);
+        free(last);
+        return false;
+    }
+
+    if (!pq || !pq->size)
+        report(3, "Warning: Calling pop on empty priority queue");
+    error_check();
+
+    if (pq && pq->size > BIG_LIST_SIZE)
+        set_cautious_mode(false);
+
+    bool ok = true;
+    if (pq && exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            element_t *e = pq_pop(pq, removes, string_length + 1);
+            if (!e) {
+                fail_count++;
+                if (fail_count < fail_limit) {
+                    report(2, "Removal from priority queue failed");
+                } else {
+                    report(1,
+                           "ERROR: Removal from priority queue failed (%d "
+                           "failures total)",
+                           fail_count);
+                    ok = false;
+                }
+                break;
+            }
+
+            if (strcmp(removes, e->value)) {
+                report(1, "ERROR: Failed to store removed value");
+                ok = false;
+            }
+            int c = r ? strcmp(last, removes) : 0;
+            if (pq->descend ? c < 0 : c > 0) {
+                report(1, "ERROR: Removed %s after %s, out of %s order",
+                       removes, last,
+                       pq->descend ? "descending" : "ascending");
+                ok = false;
+            }
+            report(2, "Removed %s from priority queue", removes);
+            q_release_element(e);
+            memcpy(last, removes, string_length + 1);
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    set_cautious_mode(true);
+    free(removes);
+    free(last);
+    pq_show(3);
+    return ok && !error_check();
+}
+
+static bool do_pq_peek(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    element_t *top = pq ? pq_peek(pq) : NULL;
+    if (!top) {
+        report(argc == 2 ? 1 : 3, "%sPriority queue is empty",
+               argc == 2 ? "ERROR: " : "Warning: ");
+        return argc == 1;
+    }
+
+    report(2, "Next in priority queue: %s", top->value);
+    if (argc == 2 && strcmp(top->value, argv[1])) {
+        report(1, "ERROR: Next value %s != expected value %s", top->value,
+               argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_pq_free(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (pq && pq->size > BIG_LIST_SIZE)
+        set_cautious_mode(false);
+    if (exception_setup(true)) {
+        pq_free(pq);
+        pq = NULL;
+    }
+    exception_cancel();
+    set_cautious_mode(true);
+
+    pq_show(3);
+    return !error_check();
+}
+
+/* Number of items each producer inserts by default */
+#define MPMC_ITEMS 100000
+
+/* Upper bound on the threads of one side of the stress test, so that both
+ * sides together fit the lock-free queue */
+#define MPMC_MAX_THREADS (LFQ_MAX_THREADS / 2)
+
+/**
+ * cq_ops_t - Operations of a queue shared between threads
+ * @name: name of the queue in reports
+ * @create: create an empty queue, NULL for allocation failed
+ * @destroy: free the queue once no thread is using it
+ * @insert: insert a copy of a string at the tail
+ * @remove: remove the element at the head and copy its string
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *q);
+    bool (*insert)(void *q, const char *s);
+    bool (*remove)(void *q, char *sp, size_t bufsize);
+} cq_ops_t;
+
+static void *mutex_create(void)
+{
+    return tlq_new(true);
+}
+
+static void *twolock_create(void)
+{
+    return tlq_new(false);
+}
+
+static void tlq_destroy(void *q)
+{
+    tlq_free(q);
+}
+
+static bool tlq_insert(void *q, const char *s)
+{
+    return tlq_insert_tail(q, s);
+}
+
+static bool tlq_remove(void *q, char *sp, size_t bufsize)
+{
+    return tlq_remove_head(q, sp, bufsize);
+}
+
+static void *lockfree_create(void)
+{
+    return lfq_new();
+}
+
+static void lfq_destroy(void *q)
+{
+    lfq_free(q);
+}
+
+static bool lfq_insert(void *q, const char *s)
+{
+    return lfq_insert_tail(q, s);
+}
+
+static bool lfq_remove(void *q, char *sp, size_t bufsize)
+{
+    return lfq_remove_head(q, sp, bufsize);
+}
+
+static const cq_ops_t cq_mutex = {"mutex", mutex_create, tlq_destroy,
+                                  tlq_insert, tlq_remove};
+static const cq_ops_t cq_twolock = {"two-lock", twolock_create, tlq_destroy,
+                                    tlq_insert, tlq_remove};
+static const cq_ops_t cq_lockfree = {"lock-free", lockfree_create,
+                                     lfq_destroy, lfq_insert, lfq_remove};
+
+/**
+ * mpmc_worker_t - A producer or consumer thread of the stress test
+ * @ops: operations of the queue
+ * @q: queue shared by all the workers
+ * @id: index of the producer, or -1 for a consumer
+ * @items: number of items each producer inserts
+ * @left: number of items not consumed yet, shared by all the workers
+ * @failed: whether an insertion failed, shared by all the workers
+ * @count: number of items the worker inserted or removed
+ * @sum: checksum of the items the worker inserted or removed
+ * @tid: thread running the worker
+ */
+typedef struct {
+    const cq_ops_t *ops;
+    void *q;
+    int id;
+    int items;
+    long *left;
+    bool *failed;
+    long count;
+    uint64_t sum;
+    pthread_t tid;
+} mpmc_worker_t;
+
+/**
+ * mpmc_result_t - Outcome of one run of the stress test
+ * @sent: number of items inserted by the producers
+ * @received: number of items removed by the consumers
+ * @sent_sum: checksum of the items inserted
+ * @received_sum: checksum of the items removed
+ * @failed: whether an insertion failed
+ * @left_over: whether the queue still held items after the run
+ * @elapsed: wall-clock time of the run in seconds
+ */
+typedef struct {
+    long sent, received;
+    uint64_t sent_sum, received_sum;
+    bool failed;
+    bool left_over;
+    double elapsed;
+} mpmc_result_t;
+
+/* FNV-1a hash of @s, summed over the items to check none is lost or forged */
+static uint64_t mpmc_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void *mpmc_worker(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    char buf[32];
+
+    if (w->id >= 0) {
+        for (int i = 0; i < w->items; i++) {
+            snprintf(buf, sizeof(buf), "p%d-%d", w->id, i);
+            if (!w->ops->insert(w->q, buf)) {
+                // Nothing will be left to consume for the missing items
+                __atomic_store_n(w->failed, true, __ATOMIC_RELAXED);
+                __atomic_fetch_sub(w->left, w->items - i, __ATOMIC_RELAXED);
+                break;
+            }
+            w->sum += mpmc_hash(buf);
+            w->count++;
+        }
+        return NULL;
+    }
+
+    while (__atomic_load_n(w->left, __ATOMIC_RELAXED) > 0) {
+        if (!w->ops->remove(w->q, buf, sizeof(buf))) {
+            sched_yield();
+            continue;
+        }
+        w->sum += mpmc_hash(buf);
+        w->count++;
+        __atomic_fetch_sub(w->left, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Pass @items items from each of @producers threads to @consumers threads
+ * through a queue created by @ops, and collect the outcome in @res.
+ *
+ * Return: false if the queue could not be created.
+ */
+static bool mpmc_run(const cq_ops_t *ops,
+                     int producers,
+                     int consumers,
+                     int items,
+                     mpmc_result_t *res)
+{
+    void *q = ops->create();
+    if (!q) {
+        report(1, "ERROR: Could not create %s queue", ops->name);
+        return false;
+    }
+
+    int n = producers + consumers;
+    long left = (long) producers * items;
+    bool failed = false;
+    mpmc_worker_t workers[2 * MPMC_MAX_THREADS];
+    bool spawned[2 * MPMC_MAX_THREADS] = {false};
+    for (int i = 0; i < n; i++) {
+        workers[i] = (mpmc_worker_t){
+            .ops = ops,
+            .q = q,
+            .id = i < producers ? i : -1,
+            .items = items,
+            .left = &left,
+            .failed = &failed,
+        };
+    }
+
+    /* Same as for the sort threads, keep SIGALRM for the calling thread. A
+     * worker whose thread cannot be created runs on the calling thread once
+     * the others are started, producers first, so consumers always finish.
+     */
+    double start = 0;
+    delta_time(&start);
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+    for (int i = 0; i < n; i++)
+        spawned[i] =
+            !pthread_create(&workers[i].tid, NULL, mpmc_worker, &workers[i]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (int i = 0; i < n; i++) {
+        if (!spawned[i])
+            mpmc_worker(&workers[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        if (spawned[i])
+            pthread_join(workers[i].tid, NULL);
+    }
+
+    *res = (mpmc_result_t){.elapsed = delta_time(&start), .failed = failed};
+    for (int i = 0; i < n; i++) {
+        if (workers[i].id >= 0) {
+            res->sent += workers[i].count;
+            res->sent_sum += workers[i].sum;
+        } else {
+            res->received += workers[i].count;
+            res->received_sum += workers[i].sum;
+        }
+    }
+    res->left_over = ops->remove(q, NULL, 0);
+    ops->destroy(q);
+    return true;
+}
+
+/* Report what went wrong in @res, if anything */
+static bool mpmc_check(const cq_ops_t *ops, const mpmc_result_t *res)
+{
+    bool ok = true;
+    if (res->failed) {
+        report(1, "ERROR: Insertion into %s queue failed", ops->name);
+        ok = false;
+    }
+    if (res->left_over || res->sent != res->received ||
+        res->sent_sum != res->received_sum) {
+        report(1, "ERROR: Sent %ld items through %s queue, received %ld",
+               res->sent, ops->name, res->received);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool do_mpmc(int argc, char *argv[])
+{
+    int producers = 4, consumers = 4, items = MPMC_ITEMS;
+
+    if (argc > 4) {
+        report(1, "%s takes 0-3 arguments", argv[0]);
+        return false;
+    }
+    if ((argc > 1 && !get_int(argv[1], &producers)) ||
+        (argc > 2 && !get_int(argv[2], &consumers)) ||
+        (argc > 3 && !get_int(argv[3], &items)) || producers < 1 ||
+        producers > MPMC_MAX_THREADS || consumers < 1 ||
+        consumers > MPMC_MAX_THREADS || items < 0) {
+        report(1,
+               "Invalid arguments for %s (1-%d producers, 1-%d consumers, "
+               "at least 0 items)",
+               argv[0], MPMC_MAX_THREADS, MPMC_MAX_THREADS);
+        return false;
+    }
+
+    mpmc_result_t res;
+    if (!mpmc_run(&cq_lockfree, producers, consumers, items, &res))
+        return false;
+
+    report(1, "%d producers, %d consumers: %ld items in %.3f s (%.0f items/s)",
+           producers, consumers, res.received, res.elapsed,
+           res.elapsed > 0 ? res.received / res.elapsed : 0.0);
+    report(1, "Checksum sent %016" PRIx64 ", received %016" PRIx64,
+           res.sent_sum, res.received_sum);
+    return mpmc_check(&cq_lockfree, &res);
+}
+
+static bool do_cqbench(int argc, char *argv[])
+{
+    int max_threads = 8, items = 4 * MPMC_ITEMS;
+
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    if ((argc > 1 && !get_int(argv[1], &max_threads)) ||
+        (argc > 2 && !get_int(argv[2], &items)) || max_threads < 1 ||
+        max_threads > MPMC_MAX_THREADS || items < 0) {
+        report(1,
+               "Invalid arguments for %s (1-%d threads, at least 0 items)",
+               argv[0], MPMC_MAX_THREADS);
+        return false;
+    }
+
+    const cq_ops_t *ops[] = {&cq_mutex, &cq_twolock, &cq_lockfree};
+    report(1, "Million items/s with N producers and N consumers");
+    report(1, "%8s %10s %10s %10s", "N", ops[0]->name, ops[1]->name,
+           ops[2]->name);
+
+    // Double the threads up to the maximum, which is always measured
+    bool ok = true;
+    for (int t = 1;; t = 2 * t < max_threads ? 2 * t : max_threads) {
+        double rate[3];
+        for (int i = 0; i < 3; i++) {
+            mpmc_result_t res;
+            if (!mpmc_run(ops[i], t, t, items / t, &res))
+                return false;
+            ok = mpmc_check(ops[i], &res) && ok;
+            rate[i] = res.elapsed > 0 ? res.received / res.elapsed / 1e6 : 0;
+        }
+        report(1, "%8d %10.2f %10.2f %10.2f", t, rate[0], rate[1], rate[2]);
+        if (t == max_threads)
+            break;
+    }
+    return ok;
+}
+
 static bool do_show(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1072,6 +2010,14 @@ static bool do_next(int argc, char *argv[])
 }
 
 
+/* Give back the pooled elements a lowered cap no longer allows */
+static void pool_cap_changed(int oldval)
+{
+    if (pool_cap < 0)
+        pool_cap = 0;
+    q_pool_trim(pool_cap);
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1094,6 +2040,8 @@ static void console_init()
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
         "[str]");
+    ADD_COMMAND(rhn, "Remove n elements from head of queue at once", "n");
+    ADD_COMMAND(rtn, "Remove n elements from tail of queue at once", "n");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
@@ -1113,6 +2061,38 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(flush, "Release the deleted elements kept in the graveyard",
+                "");
+    ADD_COMMAND(select,
+                "Find the element at 0-based position k of the queue in "
+                "ascending/descending order (default: the lower median)",
+                "[k]");
+    ADD_COMMAND(nth,
+                "Walk to the element at 0-based position k of the queue "
+                "(default: the middle one)",
+                "[k]");
+    ADD_COMMAND(pq_push,
+                "Insert string str in priority queue n times. Generate random "
+                "string(s) if str equals RAND. The first push after pq_free "
+                "fixes the order from descend (default: n == 1)",
+                "str [n]");
+    ADD_COMMAND(pq_pop,
+                "Remove n elements in ascending/descending order from "
+                "priority queue (default: n == 1)",
+                "[n]");
+    ADD_COMMAND(pq_peek,
+                "Show the next element of priority queue, optionally compare "
+                "it to expected value str",
+                "[str]");
+    ADD_COMMAND(pq_free, "Delete priority queue", "");
+    ADD_COMMAND(mpmc,
+                "Pass items from producer to consumer threads through a "
+                "lock-free queue",
+                "[producers] [consumers] [items]");
+    ADD_COMMAND(cqbench,
+                "Compare the mutex, two-lock and lock-free queues with 1 to "
+                "N producer and consumer threads each",
+                "[N] [items]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1120,10 +2100,42 @@ static void console_init()
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
-              "Sort and merge queue in ascending/descending order", NULL);
+              "Sort and merge queue in ascending/descending order. A priority "
+              "queue keeps the order it was created with until pq_free",
+              NULL);
     add_param("prng", &prng,
               "Select the random number generator [0:/dev/urandom, 1:xor]",
               NULL);
+    add_param("sortalgo", &sortalgo,
+              "Select the sorting algorithm [0:merge, 1:tim, 2:radix]", NULL);
+    add_param("dedup", &dedup_mode,
+              "Select how dedup finds duplicates [0:adjacent, 1:hash]", NULL);
+    add_param("pool", &pool_cap,
+              "Maximum number of released elements kept for reuse",
+              pool_cap_changed);
+    add_param("arena", &arena_mode,
+              "Carve the elements of new queues out of per-queue arenas",
+              NULL);
+    add_param("shuffleblock", &shuffle_block,
+              "Minimum queue size for shuffling in cache-sized buckets "
+              "(0: never)",
+              NULL);
+    add_param("graveyard", &keep_graveyard,
+              "Keep the elements deleted by dm, dedup, ascend and descend "
+              "until flush",
+              NULL);
+    add_param("selectpart", &select_partition,
+              "Leave the queue partitioned around the element select finds",
+              NULL);
+    add_param("lazyreverse", &lazy_reverse,
+              "Reverse queues by flipping their direction instead of their "
+              "links",
+              NULL);
+    add_param("threads", &sort_threads,
+              "Number of threads used by sort and merge", NULL);
+    add_param("parallel", &sort_parallel_size,
+              "Minimum queue size for sorting or merging with multiple threads",
+              NULL);
 }
 
 /* Signal handlers */
@@ -1156,7 +2168,8 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
+    if ((current && current->size > BIG_LIST_SIZE) ||
+        (pq && pq->size > BIG_LIST_SIZE))
         set_cautious_mode(false);
 
     if (exception_setup(true)) {
@@ -1168,9 +2181,12 @@ static bool q_quit(int argc, char *argv[])
             free(qctx);
             chain.size--;
         }
+        pq_free(pq);
+        pq = NULL;
     }
 
     exception_cancel();
+    q_pool_trim(0);
     set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
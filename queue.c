@@ -1,23 +1,1269 @@
 #include "queue.h"
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "random.h"
 
 extern int prng;
+extern int sortalgo;
+extern int sort_threads;
+extern int sort_parallel_size;
+extern int dedup_mode;
+extern int pool_cap;
+extern int arena_mode;
+extern int shuffle_block;
+extern int lazy_reverse;
+extern int keep_graveyard;
+extern int select_partition;
+
+/* Ways of finding duplicates selectable with the 'dedup' option of qtest */
+enum {
+    DEDUP_ADJACENT,
+    DEDUP_HASH,
+};
+
 static inline int min(int a, int b)
 {
-    return b ^ ((a ^ b) & -(a < b));
+    return b ^ ((a ^ b) & -(a < b));
+}
+
+/**
+ * queue_head_t - Header of a queue allocated by q_new()
+ * @head: sentinel node of the list, the only part callers ever see
+ * @size: number of elements currently linked after @head
+ * @child: first child while the queue sits in the merge heap of q_merge()
+ * @sibling: next sibling while the queue sits in the merge heap
+ * @rank: position of the queue in the chain being merged
+ * @arena: whether new elements are carved out of the chunks of the queue
+ * @chunks: arena chunks owned by the queue, the one being filled last
+ * @foreign: number of elements in the queue that are not in an arena chunk
+ * @reversed: whether the queue runs from @head.prev to @head.next, which
+ *            lets q_reverse() turn it around without touching any node
+ * @mid: node number (@size - 1) / 2 of the links, which q_delete_mid()
+ *       removes, or NULL when it has to be found again
+ * @graveyard: elements the delete operations unlinked and did not release yet
+ * @buried: number of elements in @graveyard
+ * @spine: blocks of the unrolled list holding the elements in link order
+ * @spare: empty blocks kept for @spine
+ * @ring: circular array holding the elements in link order
+ * @ring_aux: array as large as @ring, for sorting
+ * @ring_first: slot of the first element in @ring
+ * @ring_len: number of elements in @ring
+ * @ring_cap: number of slots in @ring and @ring_aux, a power of two
+ * @mirror_ok: whether @spine, or @ring, mirrors the links
+ *
+ * Every mutator in this file keeps @size in step with the list so that
+ * q_size() does not have to walk the queue.
+ *
+ * Every element of the queue living in an arena chunk lives in one of
+ * @chunks, and @foreign counts the others, so q_free() only has to walk the
+ * list when @foreign is not zero.
+ */
+typedef struct queue_head {
+    struct list_head head;
+    int size;
+    struct queue_head *child, *sibling;
+    int rank;
+    bool arena;
+    struct list_head chunks;
+    int foreign;
+    bool reversed;
+    struct list_head *mid;
+    struct list_head graveyard;
+    int buried;
+#if defined(QUEUE_UNROLLED)
+    struct list_head spine, spare;
+    bool mirror_ok;
+#elif defined(QUEUE_RING)
+    element_t **ring, **ring_aux;
+    int ring_first, ring_len, ring_cap;
+    bool mirror_ok;
+#endif
+} queue_head_t;
+
+static inline queue_head_t *to_queue(struct list_head *head)
+{
+    return list_entry(head, queue_head_t, head);
+}
+
+/* Reverse the links of every node of the list @head */
+static void list_reverse(struct list_head *head)
+{
+    struct list_head *cur = head->next;
+    struct list_head *tmp;
+    while (cur != head) {
+        tmp = cur->next;
+        cur->next = cur->prev;
+        cur->prev = tmp;
+        cur = tmp;
+    }
+    tmp = head->next;
+    head->next = head->prev;
+    head->prev = tmp;
+}
+
+/*
+ * Keep the middle of queue @q in step with @node, just linked before or after
+ * it, while @q->size still counts the nodes from before.
+ */
+static inline void queue_mid_insert(queue_head_t *q,
+                                    struct list_head *node,
+                                    bool before)
+{
+    if (!q->size)
+        q->mid = node;
+    else if (!q->mid)
+        return;
+    else if (before && (q->size & 1))
+        q->mid = q->mid->prev;
+    else if (!before && !(q->size & 1))
+        q->mid = q->mid->next;
+}
+
+/*
+ * Keep the middle of queue @q in step with @node, lying before or after it
+ * and about to be unlinked, while @q->size still counts @node.
+ */
+static inline void queue_mid_remove(queue_head_t *q,
+                                    struct list_head *node,
+                                    bool before)
+{
+    if (!q->mid)
+        return;
+    if (q->size == 1)
+        q->mid = NULL;
+    else if (node == q->mid)
+        q->mid = q->size & 1 ? q->mid->prev : q->mid->next;
+    else if (before && !(q->size & 1))
+        q->mid = q->mid->next;
+    else if (!before && (q->size & 1))
+        q->mid = q->mid->prev;
+}
+
+/*
+ * Strings of up to POOL_GRANULE * POOL_CLASSES bytes, NUL included, get their
+ * element from a size class: the block is rounded up to a multiple of
+ * POOL_GRANULE bytes of string storage, so any element of a class can hold
+ * any string of the class when the pool hands it out again.
+ */
+#define POOL_GRANULE 16
+#define POOL_CLASSES 8
+
+/**
+ * pool - Free lists of released elements, threaded through @list.next
+ * @free: first free element of each size class
+ * @count: number of elements on all the free lists
+ */
+static struct {
+    element_t *free[POOL_CLASSES];
+    int count;
+} pool;
+
+/* Size class of a string of @len bytes, NUL included, or -1 if too long */
+static inline int pool_class(size_t len)
+{
+    return len <= POOL_GRANULE * POOL_CLASSES ? (len - 1) / POOL_GRANULE : -1;
+}
+
+void q_pool_put(element_t *e)
+{
+    int c = pool_class(strlen(e->value) + 1);
+    if (c < 0 || pool.count >= pool_cap) {
+        test_free(e);
+        return;
+    }
+    e->list.next = (struct list_head *) pool.free[c];
+    pool.free[c] = e;
+    pool.count++;
+}
+
+void q_pool_trim(int keep)
+{
+    for (int c = POOL_CLASSES - 1; c >= 0 && pool.count > keep; c--) {
+        while (pool.free[c] && pool.count > keep) {
+            element_t *e = pool.free[c];
+            pool.free[c] = (element_t *) e->list.next;
+            pool.count--;
+            test_free(e);
+        }
+    }
+}
+
+/* Copy @s, @len bytes with its NUL, into @node carved out of @slab */
+static inline element_t *element_init(element_t *node,
+                                      const char *s,
+                                      size_t len,
+                                      element_slab_t *slab)
+{
+    node->value = memcpy(node->data, s, len);
+    node->prefix = element_prefix(s);
+    node->slab = slab;
+    return node;
+}
+
+/* Allocate an element holding a copy of @s in the same block, reusing a
+ * pooled one of the right size class when there is any */
+static element_t *element_new(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    int c = pool_class(len);
+    element_t *node;
+    if (c >= 0 && pool.free[c]) {
+        node = pool.free[c];
+        pool.free[c] = (element_t *) node->list.next;
+        pool.count--;
+    } else {
+        size_t room = c < 0 ? len : (size_t) (c + 1) * POOL_GRANULE;
+        node = (element_t *) malloc(sizeof(element_t) + room);
+    }
+    if (!node)
+        return NULL;
+    return element_init(node, s, len, NULL);
+}
+
+/* Round @size up so that an element can start right after it */
+static inline size_t slab_align(size_t size)
+{
+    size_t align = __alignof__(element_t);
+    return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Carve elements for the @n strings of @strs out of a single slab and link
+ * them to @batch, in the order of @strs or, with @reverse, in the opposite
+ * one. Return false if a string is NULL or the slab cannot be allocated.
+ */
+static bool slab_fill(struct list_head *batch,
+                      char **strs,
+                      size_t n,
+                      bool reverse)
+{
+    size_t offset = slab_align(sizeof(element_slab_t)), total = offset;
+    for (size_t i = 0; i < n; i++) {
+        if (!strs[i])
+            return false;
+        total += slab_align(sizeof(element_t) + strlen(strs[i]) + 1);
+    }
+
+    element_slab_t *slab = (element_slab_t *) malloc(total);
+    if (!slab)
+        return false;
+    slab->refs = n;
+    slab->arena = false;
+
+    for (size_t i = 0; i < n; i++) {
+        element_t *node = (element_t *) ((char *) slab + offset);
+        size_t len = strlen(strs[i]) + 1;
+        element_init(node, strs[i], len, slab);
+        if (reverse)
+            list_add(&node->list, batch);
+        else
+            list_add_tail(&node->list, batch);
+        offset += slab_align(sizeof(element_t) + len);
+    }
+    return true;
+}
+
+/*
+ * Compare two elements like strcmp() on their values. Unequal prefixes decide
+ * the order on their own. Equal prefixes whose last byte is zero belong to
+ * equal strings shorter than eight bytes, so only longer strings sharing their
+ * first eight bytes ever reach strcmp().
+ */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    if (!(a->prefix & 0xff))
+        return 0;
+    return strcmp(a->value + sizeof(a->prefix), b->value + sizeof(b->prefix));
+}
+
+/* Room for the elements of a new arena chunk, unless one needs more */
+#define ARENA_CHUNK_SIZE (1 << 16)
+
+/**
+ * arena_chunk_t - Chunk of the arena of a queue
+ * @slab: reference count shared with the elements carved out of the chunk
+ * @link: node in the list of chunks owned by a queue
+ * @used: bytes handed out so far
+ * @size: bytes available for elements
+ * @live: number of elements of the chunk still linked to a queue
+ *
+ * Elements deleted from the queue leave their space behind, which is only
+ * reclaimed when the whole chunk is: once it holds no live element and is no
+ * longer being filled, the queue drops its reference.
+ */
+typedef struct {
+    element_slab_t slab;
+    struct list_head link;
+    size_t used, size;
+    int live;
+} arena_chunk_t;
+
+/* Return the arena chunk @e was carved out of, or NULL */
+static inline arena_chunk_t *element_chunk(const element_t *e)
+{
+    if (!e->slab || !e->slab->arena)
+        return NULL;
+    return list_entry(e->slab, arena_chunk_t, slab);
+}
+
+/* Drop the reference of its queue on chunk @c */
+static void arena_drop(arena_chunk_t *c)
+{
+    list_del(&c->link);
+    if (!--c->slab.refs)
+        free(c);
+}
+
+/* Whether @c is the chunk @q is filling */
+static inline bool arena_current(queue_head_t *q, arena_chunk_t *c)
+{
+    return q->chunks.prev == &c->link;
+}
+
+/* Carve an element holding a copy of @s out of the arena of @q */
+static element_t *arena_element_new(queue_head_t *q, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    size_t need = slab_align(sizeof(element_t) + len);
+    size_t offset = slab_align(sizeof(arena_chunk_t));
+    arena_chunk_t *c = list_empty(&q->chunks)
+                           ? NULL
+                           : list_last_entry(&q->chunks, arena_chunk_t, link);
+
+    if (!c || c->used + need > c->size) {
+        if (c && !c->live)
+            arena_drop(c);
+        size_t size = need > ARENA_CHUNK_SIZE ? need : ARENA_CHUNK_SIZE;
+        c = (arena_chunk_t *) malloc(offset + size);
+        if (!c)
+            return NULL;
+        c->slab.refs = 1;
+        c->slab.arena = true;
+        c->used = 0;
+        c->size = size;
+        c->live = 0;
+        list_add_tail(&c->link, &q->chunks);
+    }
+
+    element_t *node = (element_t *) ((char *) c + offset + c->used);
+    c->used += need;
+    c->live++;
+    return element_init(node, s, len, &c->slab);
+}
+
+/* Create an element holding a copy of @s for queue @q */
+static element_t *queue_element_new(queue_head_t *q, const char *s)
+{
+    if (q->arena)
+        return arena_element_new(q, s);
+    element_t *node = element_new(s);
+    if (node)
+        q->foreign++;
+    return node;
+}
+
+/* Account for element @e leaving queue @q for good, which the caller has
+ * already unlinked */
+static void queue_detach(queue_head_t *q, element_t *e)
+{
+    arena_chunk_t *c = element_chunk(e);
+    if (!c) {
+        q->foreign--;
+        return;
+    }
+    /* The element keeps its chunk alive until it is released */
+    c->slab.refs++;
+    if (!--c->live && !arena_current(q, c))
+        arena_drop(c);
+}
+
+/* Release element @e of queue @q, which the caller has already unlinked */
+static void queue_release(queue_head_t *q, element_t *e)
+{
+    arena_chunk_t *c = element_chunk(e);
+    if (!c) {
+        q->foreign--;
+        q_release_element(e);
+    } else if (!--c->live && !arena_current(q, c)) {
+        arena_drop(c);
+    }
+}
+
+/* Release every element in the graveyard of queue @q */
+static void queue_flush(queue_head_t *q)
+{
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &q->graveyard, list)
+        queue_release(q, e);
+    INIT_LIST_HEAD(&q->graveyard);
+    q->buried = 0;
+}
+
+/* Number of buried elements released at once while a delete operation runs */
+#define GRAVEYARD_BATCH 64
+
+/*
+ * Unlink element @e from queue @q and leave it in the graveyard, so that the
+ * delete operations walk the queue without calling into the allocator for
+ * every element. The graveyard is released in batches small enough for the
+ * elements to still be cached, since releasing them all at the end of a long
+ * walk would take one more pass of cache misses.
+ */
+static inline void queue_bury(queue_head_t *q, element_t *e)
+{
+    list_move_tail(&e->list, &q->graveyard);
+    q->size--;
+    if (++q->buried >= GRAVEYARD_BATCH && !keep_graveyard)
+        queue_flush(q);
+}
+
+/*
+ * End a delete operation on queue @q, leaving its graveyard for q_flush() if
+ * the graveyard option asks to.
+ */
+static void queue_reap(queue_head_t *q)
+{
+    if (!keep_graveyard)
+        queue_flush(q);
+}
+
+#if defined(QUEUE_UNROLLED) && defined(QUEUE_RING)
+#error "QUEUE_UNROLLED and QUEUE_RING exclude each other"
+#endif
+
+#if defined(QUEUE_UNROLLED)
+/* Number of element pointers held by a block of the unrolled list */
+#define SPINE_BLOCK 32
+
+/**
+ * struct spine_block - block of the unrolled list mirroring a queue
+ * @link: neighbouring blocks of the queue
+ * @first: slot of the first element in @elem
+ * @count: number of elements, in @elem[@first] to @elem[@first + @count - 1]
+ * @elem: the elements, in the order of the links of the queue
+ */
+typedef struct spine_block {
+    struct list_head link;
+    int first, count;
+    element_t *elem[SPINE_BLOCK];
+} spine_block_t;
+
+static void spine_init(queue_head_t *q)
+{
+    INIT_LIST_HEAD(&q->spine);
+    INIT_LIST_HEAD(&q->spare);
+    q->mirror_ok = true;
+}
+
+/* Take an empty block for queue @q from its spares, or allocate it if @grow */
+static spine_block_t *spine_block_get(queue_head_t *q, bool grow)
+{
+    spine_block_t *b = NULL;
+    if (!list_empty(&q->spare)) {
+        b = list_first_entry(&q->spare, spine_block_t, link);
+        list_del(&b->link);
+    } else if (grow) {
+        b = (spine_block_t *) malloc(sizeof(spine_block_t));
+    }
+    return b;
+}
+
+/*
+ * Keep block @b of queue @q as a spare once it is empty. The blocks are only
+ * freed with the queue, so removals never call free().
+ */
+static inline void spine_block_put(queue_head_t *q, spine_block_t *b)
+{
+    list_move(&b->link, &q->spare);
+}
+
+/*
+ * Write the elements of queue @q into its blocks again by walking the links,
+ * packing them, and allocating more blocks only if @grow. The blocks of @q
+ * always have room for its elements while they mirror it, so reordering the
+ * queue needs no allocation.
+ */
+static void spine_refill(queue_head_t *q, bool grow)
+{
+    spine_block_t *b = NULL;
+    struct list_head *node;
+
+    list_splice_init(&q->spine, &q->spare);
+    q->mirror_ok = false;
+    list_for_each (node, &q->head) {
+        if (!b || b->count == SPINE_BLOCK) {
+            b = spine_block_get(q, grow);
+            if (!b)
+                return;
+            b->first = 0;
+            b->count = 0;
+            list_add_tail(&b->link, &q->spine);
+        }
+        b->elem[b->count++] = list_entry(node, element_t, list);
+    }
+    q->mirror_ok = true;
+}
+
+/* Write the @n links of @nodes, the new order of queue @q, into its blocks */
+static void spine_load(queue_head_t *q, struct list_head **nodes, int n)
+{
+    if (!q->mirror_ok)
+        return;
+
+    spine_block_t *b;
+    list_splice_init(&q->spine, &q->spare);
+    for (int i = 0; i < n; i += b->count) {
+        b = spine_block_get(q, false);
+        b->first = 0;
+        b->count = min(n - i, SPINE_BLOCK);
+        for (int j = 0; j < b->count; j++)
+            b->elem[j] = list_entry(nodes[i + j], element_t, list);
+        list_add_tail(&b->link, &q->spine);
+    }
+}
+
+/*
+ * Swap every two adjacent elements in the blocks of queue @q, leaving its
+ * links to the caller.
+ * Return: false, as the links are not rebuilt
+ */
+static bool spine_swap(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return false;
+
+    element_t **pending = NULL;
+    spine_block_t *b;
+    list_for_each_entry (b, &q->spine, link) {
+        for (int i = b->first; i < b->first + b->count; i++) {
+            if (!pending) {
+                pending = &b->elem[i];
+                continue;
+            }
+            element_t *tmp = *pending;
+            *pending = b->elem[i];
+            b->elem[i] = tmp;
+            pending = NULL;
+        }
+    }
+    return false;
+}
+
+/* Add element @e, just linked at the front or the back, to queue @q */
+static void spine_push(queue_head_t *q, element_t *e, bool front)
+{
+    if (!q->mirror_ok)
+        return;
+
+    spine_block_t *b = NULL;
+    if (front) {
+        if (!list_empty(&q->spine))
+            b = list_first_entry(&q->spine, spine_block_t, link);
+        if (!b || !b->first) {
+            if (!(b = spine_block_get(q, true)))
+                goto stale;
+            b->first = SPINE_BLOCK;
+            b->count = 0;
+            list_add(&b->link, &q->spine);
+        }
+        b->elem[--b->first] = e;
+    } else {
+        if (!list_empty(&q->spine))
+            b = list_last_entry(&q->spine, spine_block_t, link);
+        if (!b || b->first + b->count == SPINE_BLOCK) {
+            if (!(b = spine_block_get(q, true)))
+                goto stale;
+            b->first = 0;
+            b->count = 0;
+            list_add_tail(&b->link, &q->spine);
+        }
+        b->elem[b->first + b->count] = e;
+    }
+    b->count++;
+    return;
+
+stale:
+    q->mirror_ok = false;
+}
+
+/* Drop the @n elements at the front or the back of the links of queue @q */
+static void spine_pop(queue_head_t *q, int n, bool front)
+{
+    if (!q->mirror_ok)
+        return;
+
+    while (n) {
+        spine_block_t *b =
+            front ? list_first_entry(&q->spine, spine_block_t, link)
+                  : list_last_entry(&q->spine, spine_block_t, link);
+        int k = min(n, b->count);
+        if (front)
+            b->first += k;
+        b->count -= k;
+        n -= k;
+        if (!b->count)
+            spine_block_put(q, b);
+    }
+}
+
+/* Find the block holding element number @i of the links of queue @q, whose
+ * slot in the block goes to @slot */
+static spine_block_t *spine_find(queue_head_t *q, int i, int *slot)
+{
+    spine_block_t *b;
+    if (i < q->size / 2) {
+        list_for_each_entry (b, &q->spine, link) {
+            if (i < b->count)
+                break;
+            i -= b->count;
+        }
+    } else {
+        i = q->size - 1 - i;
+        for (b = list_last_entry(&q->spine, spine_block_t, link);
+             i >= b->count;
+             b = list_entry(b->link.prev, spine_block_t, link))
+            i -= b->count;
+        i = b->count - 1 - i;
+    }
+    *slot = b->first + i;
+    return b;
+}
+
+/* Return element number @i of the links of queue @q, or NULL if unknown */
+static element_t *spine_at(queue_head_t *q, int i)
+{
+    if (!q->mirror_ok)
+        return NULL;
+    int slot;
+    return spine_find(q, i, &slot)->elem[slot];
+}
+
+/* Drop element number @i of the links of queue @q, merging its block with the
+ * next one when they fit in one */
+static void spine_remove(queue_head_t *q, int i)
+{
+    if (!q->mirror_ok)
+        return;
+
+    int slot;
+    spine_block_t *b = spine_find(q, i, &slot);
+    memmove(&b->elem[slot], &b->elem[slot + 1],
+            (b->first + b->count - slot - 1) * sizeof(element_t *));
+    if (!--b->count) {
+        spine_block_put(q, b);
+        return;
+    }
+
+    /* Keep the blocks at least a quarter full */
+    if (b->count >= SPINE_BLOCK / 4 || b->link.next == &q->spine)
+        return;
+    spine_block_t *next = list_entry(b->link.next, spine_block_t, link);
+    if (b->count + next->count > SPINE_BLOCK)
+        return;
+    memmove(b->elem, &b->elem[b->first], b->count * sizeof(element_t *));
+    memcpy(&b->elem[b->count], &next->elem[next->first],
+           next->count * sizeof(element_t *));
+    b->first = 0;
+    b->count += next->count;
+    spine_block_put(q, next);
+}
+
+/* Turn the blocks of queue @q around along with its links */
+static void spine_reverse(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return;
+
+    spine_block_t *b;
+    list_for_each_entry (b, &q->spine, link) {
+        for (int lo = 0, hi = SPINE_BLOCK - 1; lo < hi; lo++, hi--) {
+            element_t *tmp = b->elem[lo];
+            b->elem[lo] = b->elem[hi];
+            b->elem[hi] = tmp;
+        }
+        b->first = SPINE_BLOCK - b->first - b->count;
+    }
+    list_reverse(&q->spine);
+}
+
+/* Hand the blocks of queue @from to queue @to, whose elements it takes */
+static void spine_adopt(queue_head_t *to, queue_head_t *from)
+{
+    list_splice_init(&from->spine, &to->spare);
+    list_splice_init(&from->spare, &to->spare);
+    from->mirror_ok = true;
+}
+
+/* Release the elements of queue @q outside the arena through its blocks,
+ * which need not be walked one link at a time */
+static bool spine_release(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return false;
+
+    spine_block_t *b;
+    list_for_each_entry (b, &q->spine, link) {
+        for (int i = b->first; i < b->first + b->count; i++) {
+            if (!element_chunk(b->elem[i]))
+                q_release_element(b->elem[i]);
+        }
+    }
+    return true;
+}
+
+/* Fill @nodes with the links of the @n elements of queue @q */
+static bool spine_gather(queue_head_t *q, struct list_head **nodes)
+{
+    if (!q->mirror_ok)
+        return false;
+
+    spine_block_t *b;
+    list_for_each_entry (b, &q->spine, link) {
+        for (int i = b->first; i < b->first + b->count; i++)
+            *nodes++ = &b->elem[i]->list;
+    }
+    return true;
+}
+
+static void spine_free(queue_head_t *q)
+{
+    list_splice_init(&q->spine, &q->spare);
+    while (!list_empty(&q->spare)) {
+        spine_block_t *b = list_first_entry(&q->spare, spine_block_t, link);
+        list_del(&b->link);
+        free(b);
+    }
+}
+#elif defined(QUEUE_RING)
+/* Capacity of the first ring of a queue, which then doubles as needed */
+#define RING_MIN 16
+
+/* Length of the runs the ring sort starts from with an insertion sort */
+#define RING_RUN 16
+
+static void ring_init(queue_head_t *q)
+{
+    q->ring = q->ring_aux = NULL;
+    q->ring_first = q->ring_len = q->ring_cap = 0;
+    q->mirror_ok = true;
+}
+
+/* Slot of element number @i in the ring of queue @q */
+static inline element_t **ring_slot(queue_head_t *q, int i)
+{
+    return &q->ring[(q->ring_first + i) & (q->ring_cap - 1)];
+}
+
+/* Grow the ring of queue @q to hold @n elements, moving the ones it has to
+ * the start of the new ring */
+static bool ring_grow(queue_head_t *q, int n)
+{
+    int cap = q->ring_cap ? q->ring_cap : RING_MIN;
+    while (cap < n)
+        cap <<= 1;
+
+    element_t **ring = (element_t **) malloc(cap * sizeof(element_t *));
+    element_t **aux = (element_t **) malloc(cap * sizeof(element_t *));
+    if (!ring || !aux) {
+        free(ring);
+        free(aux);
+        return false;
+    }
+    for (int i = 0; i < q->ring_len; i++)
+        ring[i] = *ring_slot(q, i);
+    free(q->ring);
+    free(q->ring_aux);
+    q->ring = ring;
+    q->ring_aux = aux;
+    q->ring_first = 0;
+    q->ring_cap = cap;
+    return true;
+}
+
+/* Rebuild the links of queue @q in the order of its ring */
+static void ring_relink(queue_head_t *q)
+{
+    struct list_head *prev = &q->head;
+    for (int i = 0; i < q->ring_len; i++) {
+        struct list_head *node = &(*ring_slot(q, i))->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+}
+
+/* Swap the elements in slots @i and @j of the ring of queue @q */
+static inline void ring_swap(queue_head_t *q, int i, int j)
+{
+    element_t **a = ring_slot(q, i), **b = ring_slot(q, j);
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/*
+ * Write the elements of queue @q into its ring again by walking the links,
+ * growing the ring only if @grow. Reordering a queue keeps its size, so its
+ * ring has room for it without any allocation.
+ */
+static void ring_refill(queue_head_t *q, bool grow)
+{
+    struct list_head *node;
+
+    q->mirror_ok = false;
+    q->ring_len = 0;
+    if (q->size > q->ring_cap && (!grow || !ring_grow(q, q->size)))
+        return;
+    q->ring_first = 0;
+    list_for_each (node, &q->head)
+        q->ring[q->ring_len++] = list_entry(node, element_t, list);
+    q->mirror_ok = true;
+}
+
+/* Write the @n links of @nodes, the new order of queue @q, into its ring */
+static void ring_load(queue_head_t *q, struct list_head **nodes, int n)
+{
+    if (!q->mirror_ok)
+        return;
+    q->ring_first = 0;
+    q->ring_len = n;
+    for (int i = 0; i < n; i++)
+        q->ring[i] = list_entry(nodes[i], element_t, list);
+}
+
+/*
+ * Swap every two adjacent elements of queue @q in its ring, then relink it.
+ * Return: true if the links were rebuilt, false if the ring is out of date
+ */
+static bool ring_swap_pairs(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return false;
+    for (int i = 0; i + 1 < q->ring_len; i += 2)
+        ring_swap(q, i, i + 1);
+    ring_relink(q);
+    return true;
+}
+
+/*
+ * Reverse the elements of queue @q @k at a time in its ring, then relink it.
+ * Return: true if the links were rebuilt, false if the ring is out of date
+ */
+static bool ring_reverse_k(queue_head_t *q, int k)
+{
+    if (!q->mirror_ok)
+        return false;
+    for (int lo = 0; lo + k <= q->ring_len; lo += k) {
+        for (int i = lo, j = lo + k - 1; i < j; i++, j--)
+            ring_swap(q, i, j);
+    }
+    ring_relink(q);
+    return true;
+}
+
+/* Whether @a goes strictly before @b in the order of a sort */
+static inline bool ring_before(const element_t *a,
+                               const element_t *b,
+                               bool descend)
+{
+    int cmp = element_cmp(a, b);
+    return descend ? cmp > 0 : cmp < 0;
+}
+
+/*
+ * Sort queue @q in its ring with a stable merge sort going back and forth
+ * between the ring and its auxiliary array, then relink it.
+ * Return: true if the links were rebuilt, false if the ring is out of date
+ */
+static bool ring_sort(queue_head_t *q, bool descend)
+{
+    if (!q->mirror_ok)
+        return false;
+
+    int n = q->ring_len;
+    element_t **src = q->ring_aux, **dst = q->ring;
+    for (int i = 0; i < n; i++)
+        src[i] = *ring_slot(q, i);
+
+    for (int lo = 0; lo < n; lo += RING_RUN) {
+        int hi = min(lo + RING_RUN, n);
+        for (int i = lo + 1; i < hi; i++) {
+            element_t *e = src[i];
+            int j = i;
+            for (; j > lo && ring_before(e, src[j - 1], descend); j--)
+                src[j] = src[j - 1];
+            src[j] = e;
+        }
+    }
+    for (int width = RING_RUN; width < n; width <<= 1) {
+        for (int lo = 0; lo < n; lo += 2 * width) {
+            int mid = min(lo + width, n), hi = min(lo + 2 * width, n);
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi)
+                dst[k++] = ring_before(src[j], src[i], descend) ? src[j++]
+                                                                : src[i++];
+            while (i < mid)
+                dst[k++] = src[i++];
+            while (j < hi)
+                dst[k++] = src[j++];
+        }
+        element_t **tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != q->ring)
+        memcpy(q->ring, src, n * sizeof(element_t *));
+    q->ring_first = 0;
+    ring_relink(q);
+    return true;
+}
+
+/* Add element @e, just linked at the front or the back, to queue @q */
+static void ring_push(queue_head_t *q, element_t *e, bool front)
+{
+    if (!q->mirror_ok)
+        return;
+    if (q->ring_len == q->ring_cap && !ring_grow(q, q->ring_len + 1)) {
+        q->mirror_ok = false;
+        return;
+    }
+    if (front) {
+        q->ring_first = (q->ring_first - 1) & (q->ring_cap - 1);
+        q->ring[q->ring_first] = e;
+    } else {
+        *ring_slot(q, q->ring_len) = e;
+    }
+    q->ring_len++;
+}
+
+/* Drop the @n elements at the front or the back of the links of queue @q */
+static void ring_pop(queue_head_t *q, int n, bool front)
+{
+    if (!q->mirror_ok)
+        return;
+    if (front)
+        q->ring_first = (q->ring_first + n) & (q->ring_cap - 1);
+    q->ring_len -= n;
+}
+
+/* Return element number @i of the links of queue @q, or NULL if unknown */
+static element_t *ring_at(queue_head_t *q, int i)
+{
+    return q->mirror_ok ? *ring_slot(q, i) : NULL;
+}
+
+/* Drop element number @i of the links of queue @q, closing the gap from the
+ * nearer end of the ring */
+static void ring_remove(queue_head_t *q, int i)
+{
+    if (!q->mirror_ok)
+        return;
+    if (i < q->ring_len / 2) {
+        for (; i > 0; i--)
+            *ring_slot(q, i) = *ring_slot(q, i - 1);
+        q->ring_first = (q->ring_first + 1) & (q->ring_cap - 1);
+    } else {
+        for (; i < q->ring_len - 1; i++)
+            *ring_slot(q, i) = *ring_slot(q, i + 1);
+    }
+    q->ring_len--;
+}
+
+/* Turn the ring of queue @q around along with its links */
+static void ring_reverse(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return;
+    for (int i = 0, j = q->ring_len - 1; i < j; i++, j--)
+        ring_swap(q, i, j);
+}
+
+/* Let queue @to, which takes the elements of queue @from, keep the larger of
+ * their rings */
+static void ring_adopt(queue_head_t *to, queue_head_t *from)
+{
+    if (from->ring_cap > to->ring_cap) {
+        element_t **ring = to->ring, **aux = to->ring_aux;
+        int cap = to->ring_cap;
+        to->ring = from->ring;
+        to->ring_aux = from->ring_aux;
+        to->ring_cap = from->ring_cap;
+        from->ring = ring;
+        from->ring_aux = aux;
+        from->ring_cap = cap;
+    }
+    from->ring_first = from->ring_len = 0;
+    from->mirror_ok = true;
+}
+
+/* Release the elements of queue @q outside the arena through its ring */
+static bool ring_release(queue_head_t *q)
+{
+    if (!q->mirror_ok)
+        return false;
+    for (int i = 0; i < q->ring_len; i++) {
+        element_t *e = *ring_slot(q, i);
+        if (!element_chunk(e))
+            q_release_element(e);
+    }
+    return true;
+}
+
+/* Fill @nodes with the links of the elements of queue @q */
+static bool ring_gather(queue_head_t *q, struct list_head **nodes)
+{
+    if (!q->mirror_ok)
+        return false;
+    for (int i = 0; i < q->ring_len; i++)
+        nodes[i] = &(*ring_slot(q, i))->list;
+    return true;
+}
+
+static void ring_free(queue_head_t *q)
+{
+    free(q->ring);
+    free(q->ring_aux);
+}
+#endif
+
+/*
+ * The mirror of a queue is only reached through the mirror_*() functions
+ * below. An unrolled build mirrors the links with the blocks of spine_*(), a
+ * ring build with the array of ring_*(), and other builds keep no mirror, so
+ * the links are all there is to a queue. Operations a mirror cannot do in
+ * place return false, and the caller reorders the links instead, then calls
+ * mirror_refill().
+ */
+static inline void mirror_init(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_init(q);
+#elif defined(QUEUE_RING)
+    ring_init(q);
+#endif
+}
+
+/* Write the elements of queue @q into its mirror again by walking the links */
+static inline void mirror_refill(queue_head_t *q, bool grow)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_refill(q, grow);
+#elif defined(QUEUE_RING)
+    ring_refill(q, grow);
+#endif
+}
+
+/* Write the @n links of @nodes, the new order of queue @q, into its mirror */
+static inline void mirror_load(queue_head_t *q, struct list_head **nodes, int n)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_load(q, nodes, n);
+#elif defined(QUEUE_RING)
+    ring_load(q, nodes, n);
+#endif
+}
+
+/* Swap every two adjacent elements in the mirror of queue @q.
+ * Return: true if the links were rebuilt as well */
+static inline bool mirror_swap(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED)
+    return spine_swap(q);
+#elif defined(QUEUE_RING)
+    return ring_swap_pairs(q);
+#else
+    return false;
+#endif
+}
+
+/* Reverse the elements of queue @q @k at a time in its mirror.
+ * Return: true if the links were rebuilt as well */
+static inline bool mirror_reverse_k(queue_head_t *q, int k)
+{
+#if defined(QUEUE_RING)
+    return ring_reverse_k(q, k);
+#else
+    return false;
+#endif
+}
+
+/* Sort queue @q in its mirror.
+ * Return: true if the links were rebuilt as well */
+static inline bool mirror_sort(queue_head_t *q, bool descend)
+{
+#if defined(QUEUE_RING)
+    return ring_sort(q, descend);
+#else
+    return false;
+#endif
+}
+
+/* Add element @e, just linked at the front or the back, to queue @q */
+static inline void mirror_push(queue_head_t *q, element_t *e, bool front)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_push(q, e, front);
+#elif defined(QUEUE_RING)
+    ring_push(q, e, front);
+#endif
+}
+
+/* Drop the @n elements at the front or the back of the links of queue @q */
+static inline void mirror_pop(queue_head_t *q, int n, bool front)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_pop(q, n, front);
+#elif defined(QUEUE_RING)
+    ring_pop(q, n, front);
+#endif
+}
+
+/* Return element number @i of the links of queue @q, or NULL if unknown */
+static inline element_t *mirror_at(queue_head_t *q, int i)
+{
+#if defined(QUEUE_UNROLLED)
+    return spine_at(q, i);
+#elif defined(QUEUE_RING)
+    return ring_at(q, i);
+#else
+    return NULL;
+#endif
+}
+
+/* Drop element number @i of the links of queue @q */
+static inline void mirror_remove(queue_head_t *q, int i)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_remove(q, i);
+#elif defined(QUEUE_RING)
+    ring_remove(q, i);
+#endif
+}
+
+/* Turn the mirror of queue @q around along with its links */
+static inline void mirror_reverse(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_reverse(q);
+#elif defined(QUEUE_RING)
+    ring_reverse(q);
+#endif
+}
+
+/* Let queue @to, which takes the elements of queue @from, reuse its mirror */
+static inline void mirror_adopt(queue_head_t *to, queue_head_t *from)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_adopt(to, from);
+#elif defined(QUEUE_RING)
+    ring_adopt(to, from);
+#endif
+}
+
+/* Release the elements of queue @q outside the arena through its mirror.
+ * Return: false if the links have to be walked instead */
+static inline bool mirror_release(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED)
+    return spine_release(q);
+#elif defined(QUEUE_RING)
+    return ring_release(q);
+#else
+    return false;
+#endif
+}
+
+/* Fill @nodes with the links of the elements of queue @q from its mirror.
+ * Return: false if the links have to be walked instead */
+static inline bool mirror_gather(queue_head_t *q, struct list_head **nodes)
+{
+#if defined(QUEUE_UNROLLED)
+    return spine_gather(q, nodes);
+#elif defined(QUEUE_RING)
+    return ring_gather(q, nodes);
+#else
+    return false;
+#endif
+}
+
+static inline void mirror_free(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED)
+    spine_free(q);
+#elif defined(QUEUE_RING)
+    ring_free(q);
+#endif
+}
+
+/* Rebuild the mirror of queue @q if it stopped following the links */
+static inline void mirror_repair(queue_head_t *q)
+{
+#if defined(QUEUE_UNROLLED) || defined(QUEUE_RING)
+    if (!q->mirror_ok)
+        mirror_refill(q, true);
+#endif
+}
+
+/* Add the elements of @batch, about to be spliced at the front or the back,
+ * to queue @q */
+static void mirror_push_list(queue_head_t *q,
+                             struct list_head *batch,
+                             bool front)
+{
+#if defined(QUEUE_UNROLLED) || defined(QUEUE_RING)
+    struct list_head *node;
+    if (front) {
+        for (node = batch->prev; node != batch; node = node->prev)
+            mirror_push(q, list_entry(node, element_t, list), true);
+    } else {
+        list_for_each (node, batch)
+            mirror_push(q, list_entry(node, element_t, list), false);
+    }
+#endif
+}
+
+/* Make the links of queue @q follow its order again after a lazy reverse */
+static void queue_normalize(queue_head_t *q)
+{
+    if (q->reversed) {
+        list_reverse(&q->head);
+        mirror_reverse(q);
+        q->reversed = false;
+        q->mid = NULL;
+    }
 }
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *q = (struct list_head *) malloc(sizeof(struct list_head));
+    queue_head_t *q = (queue_head_t *) malloc(sizeof(queue_head_t));
     if (!q)
         return NULL;
-    INIT_LIST_HEAD(q);
-    return q;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->arena = arena_mode;
+    INIT_LIST_HEAD(&q->chunks);
+    q->foreign = 0;
+    q->reversed = false;
+    q->mid = NULL;
+    INIT_LIST_HEAD(&q->graveyard);
+    q->buried = 0;
+    mirror_init(q);
+    return &q->head;
+}
+
+/* Release the elements the delete operations left in the graveyard */
+void q_flush(struct list_head *head)
+{
+    if (head)
+        queue_flush(to_queue(head));
 }
 
 /* Free all storage used by queue */
@@ -26,63 +1272,153 @@ void q_free(struct list_head *head)
     if (!head)
         return;
 
+    queue_head_t *q = to_queue(head);
     element_t *it, *tmp = NULL;
-    list_for_each_entry_safe (it, tmp, head, list) {
-        free(it->value);
-        free(it);
+    queue_flush(q);
+    if (q->foreign && !mirror_release(q)) {
+        list_for_each_entry_safe (it, tmp, head, list) {
+            if (!element_chunk(it))
+                q_release_element(it);
+        }
     }
-    free(head);
+
+    /* Elements in the arena go away with their chunks */
+    while (!list_empty(&q->chunks))
+        arena_drop(list_first_entry(&q->chunks, arena_chunk_t, link));
+    mirror_free(q);
+    free(q);
 }
 
-/* Insert an element at head of queue */
-bool q_insert_head(struct list_head *head, char *s)
+/* Insert a copy of @s at the head, or the tail, of queue @head */
+static bool queue_insert(struct list_head *head, char *s, bool at_head)
 {
     if (!head || !s)
         return false;
 
-    element_t *node = (element_t *) malloc(sizeof(element_t));
+    queue_head_t *q = to_queue(head);
+    element_t *node = queue_element_new(q, s);
     if (!node)
         return false;
 
-    node->value = strdup(s);
-    if (!node->value) {
-        free(node);
-        return false;
-    }
-
-    list_add(&node->list, head);
+    mirror_repair(q);
+    bool front = at_head != q->reversed;
+    if (front)
+        list_add(&node->list, head);
+    else
+        list_add_tail(&node->list, head);
+    queue_mid_insert(q, &node->list, front);
+    mirror_push(q, node, front);
+    q->size++;
     return true;
 }
 
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    return queue_insert(head, s, true);
+}
+
 /* Insert an element at tail of queue */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (!head || !s)
-        return false;
+    return queue_insert(head, s, false);
+}
 
-    element_t *node = (element_t *) malloc(sizeof(element_t));
-    if (!node)
+/*
+ * Create elements for the @n strings of @strs the way queue @q creates them,
+ * out of its arena or out of a single slab, and link them to @batch like
+ * slab_fill() does. Return false, creating nothing, if any allocation fails.
+ */
+static bool queue_fill(queue_head_t *q,
+                       struct list_head *batch,
+                       char **strs,
+                       size_t n,
+                       bool reverse)
+{
+    if (!q->arena) {
+        if (!slab_fill(batch, strs, n, reverse))
+            return false;
+        q->foreign += n;
+        return true;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        element_t *node = strs[i] ? arena_element_new(q, strs[i]) : NULL;
+        if (!node) {
+            element_t *e, *safe;
+            list_for_each_entry_safe (e, safe, batch, list) {
+                list_del(&e->list);
+                queue_release(q, e);
+            }
+            return false;
+        }
+        if (reverse)
+            list_add(&node->list, batch);
+        else
+            list_add_tail(&node->list, batch);
+    }
+    return true;
+}
+
+/*
+ * Insert the @n strings of @strs at the head, or the tail, of queue @head,
+ * building the batch in the order it takes on the side of the links it goes
+ */
+static bool queue_insert_bulk(struct list_head *head,
+                              char **strs,
+                              size_t n,
+                              bool at_head)
+{
+    if (!head || !strs)
         return false;
 
-    node->value = strdup(s);
-    if (!node->value) {
-        free(node);
+    queue_head_t *q = to_queue(head);
+    bool front = at_head != q->reversed;
+    LIST_HEAD(batch);
+    if (n && !queue_fill(q, &batch, strs, n, front))
         return false;
-    }
 
-    list_add_tail(&node->list, head);
+    q->mid = NULL;
+    mirror_repair(q);
+    mirror_push_list(q, &batch, front);
+    if (front)
+        list_splice(&batch, head);
+    else
+        list_splice_tail(&batch, head);
+    q->size += n;
     return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/* Insert a batch of elements at head of queue */
+bool q_insert_head_bulk(struct list_head *head, char **strs, size_t n)
+{
+    return queue_insert_bulk(head, strs, n, true);
+}
+
+/* Insert a batch of elements at tail of queue */
+bool q_insert_tail_bulk(struct list_head *head, char **strs, size_t n)
+{
+    return queue_insert_bulk(head, strs, n, false);
+}
+
+/* Remove the element at the head, or the tail, of queue @head */
+static element_t *queue_remove(struct list_head *head,
+                               bool at_head,
+                               char *sp,
+                               size_t bufsize)
 {
     if (!head || list_empty(head))
         return NULL;
 
-    struct list_head *lh = head->next;
-    element_t *ele = list_entry(lh, element_t, list);
-    list_del_init(lh);
+    queue_head_t *q = to_queue(head);
+    bool front = at_head != q->reversed;
+    struct list_head *node = front ? head->next : head->prev;
+    element_t *ele = list_entry(node, element_t, list);
+    queue_mid_remove(q, node, front);
+    mirror_pop(q, 1, front);
+    list_del_init(node);
+    q->size--;
+    queue_detach(q, ele);
     if (sp) {
         size_t sz = min(strlen(ele->value), bufsize - 1);
         memcpy(sp, ele->value, sz);
@@ -91,21 +1427,102 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     return ele;
 }
 
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    return queue_remove(head, true, sp, bufsize);
+}
+
 /* Remove an element from tail of queue */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head))
-        return NULL;
+    return queue_remove(head, false, sp, bufsize);
+}
 
-    struct list_head *lt = head->prev;
-    element_t *ele = list_entry(lt, element_t, list);
-    list_del_init(lt);
-    if (sp) {
-        size_t sz = min(strlen(ele->value), bufsize - 1);
-        memcpy(sp, ele->value, sz);
-        sp[sz] = '\0';
+/* Return the @n-th node of the queue counting from 1, walking from the
+ * closer end */
+static struct list_head *queue_node(struct list_head *head, int n)
+{
+    element_t *e = n ? mirror_at(to_queue(head), n - 1) : NULL;
+    if (e)
+        return &e->list;
+
+    struct list_head *node = head;
+    int size = to_queue(head)->size;
+    if (n <= size / 2) {
+        while (n--)
+            node = node->next;
+    } else {
+        for (n = size - n + 1; n; n--)
+            node = node->prev;
     }
-    return ele;
+    return node;
+}
+
+/*
+ * Account for the @n elements of @batch leaving queue @q for good, which
+ * only takes a walk when some of them may live in the arena of @q
+ */
+static void queue_detach_list(queue_head_t *q, struct list_head *batch, int n)
+{
+    if (q->foreign == q->size)
+        q->foreign -= n;
+    else {
+        element_t *e;
+        list_for_each_entry (e, batch, list)
+            queue_detach(q, e);
+    }
+    q->size -= n;
+}
+
+/* Remove @n elements from the head, or the tail, of queue @head to the tail
+ * of @list */
+static int queue_remove_n(struct list_head *head,
+                          struct list_head *list,
+                          int n,
+                          bool at_head)
+{
+    if (!head || !list || list_empty(head) || n <= 0)
+        return 0;
+
+    queue_head_t *q = to_queue(head);
+    n = min(n, q->size);
+    q->mid = NULL;
+    LIST_HEAD(batch);
+    if (at_head != q->reversed) {
+        list_cut_position(&batch, head, queue_node(head, n));
+    } else {
+        /* Cut the elements staying in front, then put them back */
+        LIST_HEAD(keep);
+        list_cut_position(&keep, head, queue_node(head, q->size - n));
+        list_splice_init(head, &batch);
+        list_splice(&keep, head);
+    }
+    mirror_pop(q, n, at_head != q->reversed);
+    /* The batch leaves in queue order */
+    if (q->reversed)
+        list_reverse(&batch);
+    queue_detach_list(q, &batch, n);
+    list_splice_tail(&batch, list);
+    return n;
+}
+
+/* Remove the first @n elements of queue to the tail of @list */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n)
+{
+    return queue_remove_n(head, list, n, true);
+}
+
+/* Remove the last @n elements of queue to the tail of @list */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n)
+{
+    return queue_remove_n(head, list, n, false);
+}
+
+/* Return whether the links of queue run backwards after a lazy reverse */
+bool q_reversed(struct list_head *head)
+{
+    return head && to_queue(head)->reversed;
 }
 
 /* Return number of elements in queue */
@@ -113,30 +1530,43 @@ int q_size(struct list_head *head)
 {
     if (!head)
         return -1;
-    int sz = 0;
-    struct list_head *it;
-    list_for_each (it, head)
-        sz++;
-    return sz;
+    return to_queue(head)->size;
 }
 
-/* Delete the middle node in queue */
-bool q_delete_mid(struct list_head *head)
+/* Return node number (size - 1) / 2 of the non-empty list @head */
+static struct list_head *list_middle(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    if (!head || list_empty(head))
-        return false;
-
     struct list_head *slow = head->next, *fast = head->next->next;
 
     while (fast != head && fast->next != head) {
         slow = slow->next;
         fast = fast->next->next;
     }
-    element_t *tmp = list_entry(slow, element_t, list);
-    list_del(slow);
-    free(tmp->value);
-    free(tmp);
+    return slow;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return false;
+
+    queue_head_t *q = to_queue(head);
+    if (!q->mid) {
+        element_t *e = mirror_at(q, (q->size - 1) / 2);
+        q->mid = e ? &e->list : list_middle(head);
+    }
+    /* The middle of a reversed queue of even size is one node further */
+    struct list_head *node = q->mid;
+    bool further = q->reversed && !(q->size & 1);
+    if (further)
+        node = node->next;
+
+    queue_mid_remove(q, node, false);
+    mirror_remove(q, (q->size - 1) / 2 + further);
+    queue_bury(q, list_entry(node, element_t, list));
+    queue_reap(q);
     return true;
 }
 
@@ -148,32 +1578,123 @@ bool q_delete_mid(struct list_head *head)
 #define list_next_entry(pos, member) \
     list_entry((pos)->member.next, typeof(*(pos)), member)
 
+/* FNV-1a hash of a string */
+static inline uint64_t str_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * dup_slot_t - Slot of the hash table built by delete_dup_hash()
+ * @e: first element holding the string of the slot, or NULL if the slot is
+ *     free
+ * @dup: whether the string was seen again after @e
+ */
+typedef struct {
+    element_t *e;
+    bool dup;
+} dup_slot_t;
+
+/*
+ * Delete every element of the queue whose string appears more than once,
+ * wherever the copies are, by comparing each element with all the ones after
+ * it. Only used when the hash table cannot be allocated.
+ */
+static void delete_dup_scan(queue_head_t *q)
+{
+    struct list_head *cur = q->head.next;
+    while (cur != &q->head) {
+        element_t *e = list_entry(cur, element_t, list);
+        bool dup = false;
+        for (struct list_head *p = cur->next, *next; p != &q->head; p = next) {
+            element_t *other = list_entry(p, element_t, list);
+            next = p->next;
+            if (element_cmp(e, other))
+                continue;
+            queue_bury(q, other);
+            dup = true;
+        }
+        cur = cur->next;
+        if (dup)
+            queue_bury(q, e);
+    }
+}
+
+/*
+ * Delete every element of the queue whose string appears more than once,
+ * wherever the copies are, keeping the order of the others. An open
+ * addressing table sized from the queue length remembers the first element
+ * of each string, so this takes O(n) expected time.
+ */
+static void delete_dup_hash(queue_head_t *q)
+{
+    size_t cap = 16;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    dup_slot_t *table = (dup_slot_t *) calloc(cap, sizeof(dup_slot_t));
+    if (!table) {
+        delete_dup_scan(q);
+        return;
+    }
+
+    /* Drop the later copies and mark the strings they belong to... */
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &q->head, list) {
+        size_t i = str_hash(e->value) & (cap - 1);
+        while (table[i].e && element_cmp(table[i].e, e))
+            i = (i + 1) & (cap - 1);
+        if (!table[i].e) {
+            table[i].e = e;
+            continue;
+        }
+        table[i].dup = true;
+        queue_bury(q, e);
+    }
+
+    /* ...then the first copy of every marked string */
+    for (size_t i = 0; i < cap; i++) {
+        if (table[i].dup)
+            queue_bury(q, table[i].e);
+    }
+    free(table);
+}
+
 /* Delete all nodes that have duplicate string */
 bool q_delete_dup(struct list_head *head)
 {
     if (!head || list_is_singular(head) || list_empty(head))
         return false;
+    to_queue(head)->mid = NULL;
+    if (dedup_mode == DEDUP_HASH) {
+        delete_dup_hash(to_queue(head));
+        mirror_refill(to_queue(head), false);
+        queue_reap(to_queue(head));
+        return true;
+    }
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    queue_head_t *q = to_queue(head);
     struct list_head *cur = head->next;
     while (cur != head && cur->next != head) {
         element_t *e1 = list_entry(cur, element_t, list);
         element_t *e2 = list_next_entry(e1, list);
         bool flag = 0;
-        while (cur->next != head && !strcmp(e1->value, e2->value)) {
-            list_del(cur->next);
-            free(e2->value);
-            free(e2);
+        while (cur->next != head && !element_cmp(e1, e2)) {
+            queue_bury(q, e2);
             flag = 1;
             e2 = list_next_entry(e1, list);
         }
         struct list_head *tmp = cur->next;
-        if (flag) {
-            list_del(cur);
-            free(e1->value);
-            free(e1);
-        }
+        if (flag)
+            queue_bury(q, e1);
         cur = tmp;
     }
+    mirror_refill(q, false);
+    queue_reap(q);
     return true;
 }
 /**
@@ -210,6 +1731,10 @@ static inline void list_swap(struct list_head *entry1, struct list_head *entry2)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
+    queue_normalize(to_queue(head));
+    to_queue(head)->mid = NULL;
+    if (mirror_swap(to_queue(head)))
+        return;
     struct list_head *cur = head->next;
     while (cur != head && cur->next != head) {
         struct list_head *tmp = cur->next->next;
@@ -221,17 +1746,18 @@ void q_swap(struct list_head *head)
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
-    struct list_head *cur = head->next;
-    struct list_head *tmp;
-    while (cur != head) {
-        tmp = cur->next;
-        cur->next = cur->prev;
-        cur->prev = tmp;
-        cur = tmp;
+    if (!head)
+        return;
+    queue_head_t *q = to_queue(head);
+    if (lazy_reverse) {
+        q->reversed ^= true;
+        return;
     }
-    tmp = head->next;
-    head->next = head->prev;
-    head->prev = tmp;
+    list_reverse(head);
+    mirror_reverse(q);
+    /* The middle of an even number of nodes moves to the other one */
+    if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
 }
 void printlist(struct list_head *head)
 {
@@ -246,6 +1772,10 @@ void q_reverseK(struct list_head *head, int k)
     // https://leetcode.com/problems/reverse-nodes-in-k-group/
     if (k <= 1 || !head || list_empty(head) || list_is_singular(head))
         return;
+    queue_normalize(to_queue(head));
+    to_queue(head)->mid = NULL;
+    if (mirror_reverse_k(to_queue(head), k))
+        return;
 
     struct list_head *cur, *tmp;
     struct list_head *sub_head = head;
@@ -259,7 +1789,7 @@ void q_reverseK(struct list_head *head, int k)
             // cur range: [sub_head->next, ..., cur]
             list_cut_position(&sublist, sub_head, cur);
 
-            q_reverse(&sublist);
+            list_reverse(&sublist);
             /*
              * list_splice() expects the 'head' parameter to be a sentinel node
              * with no data. This places inserted elements between 'head' and
@@ -272,68 +1802,465 @@ void q_reverseK(struct list_head *head, int k)
             sub_head = tmp->prev;
         }
     }
+    mirror_refill(to_queue(head), false);
+}
+static inline bool str_cmp_asc(const element_t *a, const element_t *b)
+{
+    return element_cmp(a, b) <= 0;
+}
+static inline bool str_cmp_dsc(const element_t *a, const element_t *b)
+{
+    return element_cmp(a, b) >= 0;
+}
+
+/* Element owning list node @node */
+#define node_elem(node) list_entry(node, element_t, list)
+
+struct list_head *merge(struct list_head *l1,
+                        struct list_head *l2,
+                        bool (*cmp)(const element_t *a, const element_t *b))
+{
+    struct list_head *head = NULL, **ptr = &head, **node;
+    for (node = NULL; l1 && l2; *node = (*node)->next) {
+        node = cmp(node_elem(l1), node_elem(l2)) ? &l1 : &l2;
+        *ptr = *node;
+        ptr = &(*ptr)->next;
+    }
+    *ptr = l1 ? l1 : l2;
+    return head;
+}
+
+/* Runs of up to this many nodes are built by insertion sort before merging */
+#define SORT_RUN_LEN 4
+
+/*
+ * Take up to SORT_RUN_LEN nodes off the front of *list and return them as a
+ * sorted, NULL-terminated run. A node is inserted behind every node that
+ * compares equal to it, so the run keeps the input order of duplicates.
+ */
+static struct list_head *insertion_run(struct list_head **list,
+                                       bool (*cmp)(const element_t *a,
+                                                   const element_t *b))
+{
+    struct list_head *run = *list, *node;
+    *list = run->next;
+    run->next = NULL;
+    for (int n = 1; n < SORT_RUN_LEN && (node = *list); n++) {
+        *list = node->next;
+        struct list_head **pp = &run;
+        while (*pp && cmp(node_elem(*pp), node_elem(node)))
+            pp = &(*pp)->next;
+        node->next = *pp;
+        *pp = node;
+    }
+    return run;
+}
+
+/*
+ * Bottom-up merge sort modelled on lib/list_sort.c of the Linux kernel.
+ *
+ * Runs from insertion_run() are pushed onto a stack of pending lists chained
+ * through their prev pointers. Whenever the count of pushed runs reaches a
+ * point where its binary representation carries, the two newest pending
+ * lists of equal size are merged, so merges stay balanced at 2:1 or better
+ * without recursion or midpoint searches. The input is consumed in one pass.
+ */
+struct list_head *mergesort(struct list_head *list,
+                            bool (*cmp)(const element_t *a, const element_t *b))
+{
+    struct list_head *pending = NULL;
+    size_t count = 0;
+
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Merge two pending lists of the same size, unless count is 2^k - 1 */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+            a = merge(b, a, cmp);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        struct list_head *run = insertion_run(&list, cmp);
+        run->prev = pending;
+        pending = run;
+        count++;
+    } while (list);
+
+    /* Merge all remaining pending lists, from the newest to the oldest */
+    list = pending;
+    pending = pending->prev;
+    while (pending) {
+        struct list_head *next = pending->prev;
+        list = merge(pending, list, cmp);
+        pending = next;
+    }
+    return list;
+}
+
+/* Consecutive wins of one run before a merge switches to galloping */
+#define MIN_GALLOP 7
+
+/* Enough pending runs for any queue, since run lengths grow like Fibonacci */
+#define MAX_PENDING_RUNS 85
+
+/*
+ * Return the last node of the longest prefix of @list that belongs in front of
+ * @key, or NULL if the first node does not, and store the prefix length in
+ * *count. Nodes equal to @key are part of the prefix unless @strict is set.
+ * The prefix is bracketed by probing at offsets 1, 2, 4, ... and then
+ * bisected, so a prefix of length k costs O(log k) comparisons.
+ */
+static struct list_head *gallop(
+    struct list_head *list,
+    const element_t *key,
+    bool strict,
+    size_t *count,
+    bool (*cmp)(const element_t *a, const element_t *b))
+{
+#define before_key(node) \
+    (strict ? !cmp(key, node_elem(node)) : cmp(node_elem(node), key))
+    *count = 0;
+    if (!list || !before_key(list))
+        return NULL;
+
+    struct list_head *last = list, *node;
+    size_t step = 1, gap, pos = 1;
+    for (;;) {
+        /* gap counts the unprobed nodes between last and node */
+        node = last->next;
+        for (gap = 0; node && gap + 1 < step; gap++)
+            node = node->next;
+        if (!node || !before_key(node))
+            break;
+        last = node;
+        pos += gap + 1;
+        step <<= 1;
+    }
+
+    while (gap) {
+        size_t half = gap / 2;
+        node = last->next;
+        for (size_t i = 0; i < half; i++)
+            node = node->next;
+        if (before_key(node)) {
+            last = node;
+            pos += half + 1;
+            gap -= half + 1;
+        } else {
+            gap = half;
+        }
+    }
+    *count = pos;
+    return last;
+#undef before_key
+}
+
+/*
+ * Stable merge of two NULL-terminated runs which switches to galloping once
+ * one side keeps winning. @min_gallop carries the threshold across merges and
+ * is lowered while galloping pays off and raised when it does not.
+ */
+static struct list_head *merge_gallop(struct list_head *a,
+                                      struct list_head *b,
+                                      int *min_gallop,
+                                      bool (*cmp)(const element_t *a,
+                                                  const element_t *b))
+{
+    struct list_head *head = NULL, **tail = &head, *last;
+    int wins_a = 0, wins_b = 0;
+    size_t taken;
+
+    /* Nodes of a which do not exceed the first node of b are already placed */
+    last = gallop(a, node_elem(b), false, &taken, cmp);
+    if (last) {
+        *tail = a;
+        tail = &last->next;
+        a = last->next;
+    }
+
+    while (a && b) {
+        if (cmp(node_elem(a), node_elem(b))) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            wins_a++;
+            wins_b = 0;
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            wins_b++;
+            wins_a = 0;
+        }
+        if (!a || !b || (wins_a < *min_gallop && wins_b < *min_gallop))
+            continue;
+
+        /* Take the whole stretch the winning side still has to offer */
+        last = wins_a ? gallop(a, node_elem(b), false, &taken, cmp)
+                      : gallop(b, node_elem(a), true, &taken, cmp);
+        if (last) {
+            struct list_head **from = wins_a ? &a : &b;
+            *tail = *from;
+            tail = &last->next;
+            *from = last->next;
+        }
+        if (taken >= MIN_GALLOP && *min_gallop > 1)
+            (*min_gallop)--;
+        else if (taken < MIN_GALLOP)
+            (*min_gallop)++;
+        wins_a = wins_b = 0;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/*
+ * Detach the next natural run from the front of *list and return it as a
+ * NULL-terminated list in sorted order. A non-descending run is taken as is,
+ * while a strictly descending run is reversed in place, which cannot break
+ * stability since it holds no equal nodes. Runs shorter than @min_len are
+ * extended to that length by insertion sort.
+ */
+static struct list_head *next_run(
+    struct list_head **list,
+    size_t min_len,
+    size_t *len,
+    bool (*cmp)(const element_t *a, const element_t *b))
+{
+    struct list_head *head = *list, *tail = head, *node = head->next;
+    size_t n = 1;
+
+    if (node && !cmp(node_elem(head), node_elem(node))) {
+        head->next = NULL;
+        while (node && !cmp(node_elem(head), node_elem(node))) {
+            struct list_head *next = node->next;
+            node->next = head;
+            head = node;
+            node = next;
+            n++;
+        }
+    } else {
+        while (node && cmp(node_elem(tail), node_elem(node))) {
+            tail = node;
+            node = node->next;
+            n++;
+        }
+        tail->next = NULL;
+    }
+
+    for (; node && n < min_len; n++) {
+        struct list_head *next = node->next, **pp = &head;
+        while (*pp && cmp(node_elem(*pp), node_elem(node)))
+            pp = &(*pp)->next;
+        node->next = *pp;
+        *pp = node;
+        node = next;
+    }
+
+    *list = node;
+    *len = n;
+    return head;
+}
+
+/* Smallest run length that keeps the merges of n nodes close to balanced */
+static size_t min_run_length(size_t n)
+{
+    size_t r = 0;
+    while (n >= 64) {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
+}
+
+/* Pending run on the stack of timsort() */
+typedef struct {
+    struct list_head *head;
+    size_t len;
+} tim_run_t;
+
+/* Merge runs @i and @i + 1 of the @top runs on the stack */
+static void merge_at(tim_run_t *runs,
+                     size_t *top,
+                     size_t i,
+                     int *min_gallop,
+                     bool (*cmp)(const element_t *a, const element_t *b))
+{
+    runs[i].head =
+        merge_gallop(runs[i].head, runs[i + 1].head, min_gallop, cmp);
+    runs[i].len += runs[i + 1].len;
+    if (i + 2 < *top)
+        runs[i + 1] = runs[i + 2];
+    (*top)--;
+}
+
+/*
+ * Adaptive merge sort in the style of Timsort. Natural runs are collected on
+ * a stack whose lengths are kept decreasing faster than Fibonacci numbers, so
+ * merges stay balanced, and merging gallops through long stretches won by one
+ * run. A queue which is already sorted or strictly reversed is handled in a
+ * single linear pass.
+ */
+struct list_head *timsort(struct list_head *list,
+                          size_t n,
+                          bool (*cmp)(const element_t *a, const element_t *b))
+{
+    tim_run_t runs[MAX_PENDING_RUNS];
+    size_t min_len = min_run_length(n), top = 0;
+    int min_gallop = MIN_GALLOP;
+
+    while (list) {
+        runs[top].head = next_run(&list, min_len, &runs[top].len, cmp);
+        top++;
+
+        while (top > 1) {
+            size_t i = top - 2;
+            if ((i > 0 && runs[i - 1].len <= runs[i].len + runs[i + 1].len) ||
+                (i > 1 && runs[i - 2].len <= runs[i - 1].len + runs[i].len)) {
+                if (runs[i - 1].len < runs[i + 1].len)
+                    i--;
+            } else if (runs[i].len > runs[i + 1].len) {
+                break;
+            }
+            merge_at(runs, &top, i, &min_gallop, cmp);
+        }
+    }
+
+    while (top > 1) {
+        size_t i = top - 2;
+        if (i > 0 && runs[i - 1].len < runs[i + 1].len)
+            i--;
+        merge_at(runs, &top, i, &min_gallop, cmp);
+    }
+    return runs[0].head;
 }
-static inline bool str_cmp_asc(const char *a, const char *b)
-{
-    return strcmp(a, b) <= 0;
-}
-static inline bool str_cmp_dsc(const char *a, const char *b)
+
+/* Buckets up to this size are finished by insertion sort */
+#define RADIX_INSERTION_LEN 32
+
+/* Byte @depth of the value of @e, read from the prefix while it covers it */
+static inline unsigned char key_byte(const element_t *e, size_t depth)
 {
-    return strcmp(a, b) >= 0;
+    if (depth < sizeof(e->prefix))
+        return e->prefix >> (8 * (sizeof(e->prefix) - 1 - depth));
+    return e->value[depth];
 }
 
-struct list_head *merge(struct list_head *l1,
-                        struct list_head *l2,
-                        bool (*cmp)(const char *a, const char *b))
+/* Stable insertion sort of @v, used for the small buckets of radix_sort() */
+static void insertion_sort(element_t **v, size_t n, bool descend)
 {
-    struct list_head *head = NULL, **ptr = &head, **node;
-    for (node = NULL; l1 && l2; *node = (*node)->next) {
-        node = cmp(list_entry(l1, element_t, list)->value,
-                   list_entry(l2, element_t, list)->value)
-                   ? &l1
-                   : &l2;
-        *ptr = *node;
-        ptr = &(*ptr)->next;
+    for (size_t i = 1; i < n; i++) {
+        element_t *e = v[i];
+        size_t j = i;
+        for (; j > 0; j--) {
+            int c = element_cmp(v[j - 1], e);
+            if (descend ? c >= 0 : c <= 0)
+                break;
+            v[j] = v[j - 1];
+        }
+        v[j] = e;
     }
-    *ptr = l1 ? l1 : l2;
-    return head;
 }
 
-struct list_head *mergesort(struct list_head *head,
-                            bool (*cmp)(const char *a, const char *b))
+/*
+ * Stable MSD radix sort of the @n elements in @v, which share their first
+ * @depth bytes. Elements are distributed through @aux by their byte at
+ * @depth, and every bucket except the one of strings ending there is sorted
+ * on the next byte. Descending order simply walks the buckets backwards.
+ */
+static void radix_sort(element_t **v,
+                       element_t **aux,
+                       size_t n,
+                       size_t depth,
+                       bool descend)
 {
-    if (!head->next) {
-        return head;
+    if (n <= RADIX_INSERTION_LEN) {
+        insertion_sort(v, n, descend);
+        return;
     }
-    struct list_head *fast = head;
-    struct list_head *slow = head;
-    while (fast->next && fast->next->next) {
-        fast = fast->next->next;
-        slow = slow->next;
+
+    size_t start[257];
+    int b;
+    for (;;) {
+        memset(start, 0, sizeof(start));
+        for (size_t i = 0; i < n; i++) {
+            unsigned char c = key_byte(v[i], depth);
+            start[(descend ? 255 - c : c) + 1]++;
+        }
+        for (b = 0; b < 256 && start[b + 1] != n; b++)
+            ;
+        /* Skip distributing a byte which every element has in common */
+        if (b == 256)
+            break;
+        if (b == (descend ? 255 : 0))
+            return;
+        depth++;
+    }
+    for (b = 0; b < 256; b++)
+        start[b + 1] += start[b];
+
+    size_t pos[256];
+    memcpy(pos, start, sizeof(pos));
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = key_byte(v[i], depth);
+        aux[pos[descend ? 255 - c : c]++] = v[i];
+    }
+    memcpy(v, aux, n * sizeof(*v));
+
+    for (b = 0; b < 256; b++) {
+        size_t len = start[b + 1] - start[b];
+        bool ended = b == (descend ? 255 : 0);
+        if (len > 1 && !ended)
+            radix_sort(v + start[b], aux + start[b], len, depth + 1, descend);
     }
-    struct list_head *mid = slow->next;
-    slow->next = NULL;
-    struct list_head *left = mergesort(head, cmp);
-    struct list_head *right = mergesort(mid, cmp);
-    return merge(left, right, cmp);
 }
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+
+/*
+ * Sort the @n nodes after @head with the algorithm chosen by sortalgo. The
+ * radix sort gathers the elements into @scratch, which must hold 2 * @n
+ * pointers; the list sorts run without it when @scratch is NULL.
+ */
+static void sort_list(struct list_head *head,
+                      size_t n,
+                      bool descend,
+                      element_t **scratch)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (n < 2)
+        return;
+
+    if (scratch) {
+        element_t *e;
+        size_t i = 0;
+        list_for_each_entry (e, head, list)
+            scratch[i++] = e;
+
+        radix_sort(scratch, scratch + n, n, 0, descend);
+
+        INIT_LIST_HEAD(head);
+        for (i = 0; i < n; i++)
+            list_add_tail(&scratch[i]->list, head);
         return;
+    }
+
     /*
      * First unlink list's head and destory circular structure
      * for detect NULL in merge stage
      */
     struct list_head *tmp = head->next;
-    bool (*cmp)(const char *a, const char *b) =
+    bool (*cmp)(const element_t *a, const element_t *b) =
         descend ? str_cmp_dsc : str_cmp_asc;
     head->prev->next = NULL;
     head->next = NULL;
 
     // Sort the list and ignore prev link in this stage
-    struct list_head *sorted = mergesort(tmp, cmp);
+    struct list_head *sorted =
+        sortalgo == SORT_TIM ? timsort(tmp, n, cmp) : mergesort(tmp, cmp);
     // Recover previous link and stop at last node
     struct list_head *current = sorted;
     while (current->next) {
@@ -348,6 +2275,167 @@ void q_sort(struct list_head *head, bool descend)
     current->next = head;
 }
 
+/*
+ * Stable merge of the sorted list @b into the sorted list @a, leaving @b
+ * empty. Nodes of @a go first among equal ones.
+ */
+static void list_merge(struct list_head *a,
+                       struct list_head *b,
+                       bool (*cmp)(const element_t *a, const element_t *b))
+{
+    struct list_head *pos = a->next;
+    while (!list_empty(b)) {
+        struct list_head *node = b->next;
+        while (pos != a && cmp(node_elem(pos), node_elem(node)))
+            pos = pos->next;
+        if (pos == a) {
+            list_splice_tail_init(b, a);
+            break;
+        }
+        list_del(node);
+        list_add_tail(node, pos);
+    }
+}
+
+/* Upper bound on the number of threads a single sort or merge may use */
+#define MAX_SORT_THREADS 64
+
+/**
+ * sort_job_t - A slice of the queue sorted or merged by one thread
+ * @head: sentinel of the slice
+ * @n: number of nodes in the slice
+ * @descend: whether the slice is sorted in descending order
+ * @scratch: radix sort array for the slice, or NULL for the list sorts
+ * @other: slice to merge into this one, or NULL when sorting
+ * @tid: thread working on the slice
+ */
+typedef struct {
+    struct list_head head;
+    size_t n;
+    bool descend;
+    element_t **scratch;
+    struct list_head *other;
+    pthread_t tid;
+} sort_job_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_job_t *job = arg;
+    if (job->other)
+        list_merge(&job->head, job->other,
+                   job->descend ? str_cmp_dsc : str_cmp_asc);
+    else
+        sort_list(&job->head, job->n, job->descend, job->scratch);
+    return NULL;
+}
+
+/*
+ * Run sort_worker() for @count jobs, one thread each, and wait for all of
+ * them. A job whose thread cannot be created runs on the calling thread.
+ * SIGALRM stays blocked until every worker is joined: the time limit of the
+ * harness unwinds the calling thread, and with it @jobs, so it must not be
+ * delivered while a worker still uses them.
+ */
+static void run_sort_jobs(sort_job_t **jobs, int count)
+{
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+
+    bool spawned[MAX_SORT_THREADS] = {false};
+    for (int i = 1; i < count; i++)
+        spawned[i] = !pthread_create(&jobs[i]->tid, NULL, sort_worker, jobs[i]);
+
+    sort_worker(jobs[0]);
+    for (int i = 1; i < count; i++) {
+        if (spawned[i])
+            pthread_join(jobs[i]->tid, NULL);
+        else
+            sort_worker(jobs[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Cut the queue into one slice per thread with list_cut_position(), sort the
+ * slices concurrently and merge them back in a tree of parallel rounds.
+ * Slices stay in queue order and merges keep the left slice first among
+ * equal nodes, so the result is identical to the serial sort.
+ */
+static void parallel_sort(struct list_head *head,
+                          size_t n,
+                          int threads,
+                          bool descend,
+                          element_t **scratch)
+{
+    sort_job_t job[MAX_SORT_THREADS], *jobs[MAX_SORT_THREADS];
+    size_t offset = 0;
+
+    for (int t = 0; t < threads; t++) {
+        sort_job_t *j = &job[t];
+        j->n = n / threads + ((size_t) t < n % threads);
+        j->descend = descend;
+        j->scratch = scratch ? scratch + 2 * offset : NULL;
+        j->other = NULL;
+        offset += j->n;
+
+        struct list_head *last = head;
+        for (size_t i = 0; i < j->n; i++)
+            last = last->next;
+        INIT_LIST_HEAD(&j->head);
+        list_cut_position(&j->head, head, last);
+        jobs[t] = j;
+    }
+    run_sort_jobs(jobs, threads);
+
+    for (int width = 1; width < threads; width <<= 1) {
+        int count = 0;
+        for (int t = 0; t + width < threads; t += 2 * width) {
+            job[t].other = &job[t + width].head;
+            jobs[count++] = &job[t];
+        }
+        run_sort_jobs(jobs, count);
+    }
+    list_splice(&job[0].head, head);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    /* Sorting the links the other way round leaves a reversed queue sorted,
+     * as the sorts are stable */
+    if (to_queue(head)->reversed)
+        descend = !descend;
+    to_queue(head)->mid = NULL;
+
+    size_t n = to_queue(head)->size;
+    int threads = min(sort_threads, MAX_SORT_THREADS);
+    bool parallel = threads > 1 && n >= (size_t) sort_parallel_size &&
+                    n >= (size_t) threads;
+    /* A mirror only stands in for the serial merge sort, whose stable order
+     * it gives as well */
+    if (sortalgo == SORT_MERGE && !parallel &&
+        mirror_sort(to_queue(head), descend))
+        return;
+
+    /* The radix sort falls back to the merge sort without its scratch */
+    element_t **scratch = NULL;
+    if (sortalgo == SORT_RADIX)
+        scratch = (element_t **) malloc(2 * n * sizeof(element_t *));
+
+    if (parallel)
+        parallel_sort(head, n, threads, descend, scratch);
+    else
+        sort_list(head, n, descend, scratch);
+    if (scratch)
+        free(scratch);
+    mirror_refill(to_queue(head), false);
+}
+
 /**
  * list_for_each_prev_safe - iterate over a list backwards safe against removal
  * of list entry
@@ -363,24 +2451,26 @@ void q_sort(struct list_head *head, bool descend)
         safe = list_entry(entry->member.prev, typeof(*entry), member); \
          &entry->member != (head); entry = safe,                       \
         safe = list_entry(safe->member.prev, typeof(*entry), member))
+
 /* Remove every node which has a node with a strictly less value anywhere to
  * the right side of it */
 int q_ascend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
     element_t *cur, *tmp;
+    queue_normalize(to_queue(head));
+    to_queue(head)->mid = NULL;
     const element_t *min_node = list_last_entry(head, element_t, list);
     list_for_each_entry_prev_safe(cur, tmp, head, list)
     {
-        if (strcmp(cur->value, min_node->value) > 0) {
-            list_del(&cur->list);
-            free(cur->value);
-            free(cur);
-        } else {
+        if (element_cmp(cur, min_node) > 0)
+            queue_bury(to_queue(head), cur);
+        else
             min_node = cur;
-        }
     }
-    return q_size(head);
+    mirror_refill(to_queue(head), false);
+    queue_reap(to_queue(head));
+    return to_queue(head)->size;
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
@@ -389,18 +2479,149 @@ int q_descend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
     element_t *cur, *tmp;
+    queue_normalize(to_queue(head));
+    to_queue(head)->mid = NULL;
     const element_t *max_node = list_last_entry(head, element_t, list);
     list_for_each_entry_prev_safe(cur, tmp, head, list)
     {
-        if (strcmp(cur->value, max_node->value) < 0) {
-            list_del(&cur->list);
-            free(cur->value);
-            free(cur);
-        } else {
+        if (element_cmp(cur, max_node) < 0)
+            queue_bury(to_queue(head), cur);
+        else
             max_node = cur;
+    }
+    mirror_refill(to_queue(head), false);
+    queue_reap(to_queue(head));
+    return to_queue(head)->size;
+}
+
+/*
+ * Whether queue @a comes out of the merge heap before queue @b: the queue with
+ * the smaller (or, when descending, larger) front element wins, and the one
+ * earlier in the chain wins a tie, which keeps q_merge() stable.
+ */
+static inline bool heap_before(const queue_head_t *a,
+                               const queue_head_t *b,
+                               bool descend)
+{
+    int c = element_cmp(node_elem(a->head.next), node_elem(b->head.next));
+    if (c)
+        return descend ? c > 0 : c < 0;
+    return a->rank < b->rank;
+}
+
+/* Meld two pairing heaps of queues and return the new root */
+static queue_head_t *heap_meld(queue_head_t *a, queue_head_t *b, bool descend)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (heap_before(b, a, descend)) {
+        queue_head_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->sibling = a->child;
+    a->child = b;
+    return a;
+}
+
+/* Remove the root of a pairing heap and return the root of the rest */
+static queue_head_t *heap_pop(queue_head_t *root, bool descend)
+{
+    queue_head_t *list = root->child, *pairs = NULL;
+    root->child = NULL;
+
+    /* Meld the children in pairs from left to right... */
+    while (list) {
+        queue_head_t *a = list, *b = a->sibling;
+        if (!b) {
+            a->sibling = pairs;
+            pairs = a;
+            break;
         }
+        list = b->sibling;
+        a->sibling = b->sibling = NULL;
+        a = heap_meld(a, b, descend);
+        a->sibling = pairs;
+        pairs = a;
+    }
+
+    /* ...then fold the pairs back from right to left */
+    queue_head_t *heap = NULL;
+    while (pairs) {
+        queue_head_t *next = pairs->sibling;
+        pairs->sibling = NULL;
+        heap = heap_meld(heap, pairs, descend);
+        pairs = next;
+    }
+    return heap;
+}
+
+/* Run the merge @jobs and hand each result back to its queue in @dst */
+static void merge_jobs(sort_job_t **jobs,
+                       queue_head_t **dst,
+                       queue_head_t **src,
+                       int count)
+{
+    if (!count)
+        return;
+    run_sort_jobs(jobs, count);
+    for (int i = 0; i < count; i++) {
+        list_splice(&jobs[i]->head, &dst[i]->head);
+        dst[i]->size += src[i]->size;
+        src[i]->size = 0;
     }
-    return q_size(head);
+}
+
+/*
+ * Merge the non-empty queues of the chain into one of them in rounds: every
+ * round merges each pair of neighbouring non-empty queues into the left one,
+ * with up to @threads pairs merged concurrently, until a single queue is
+ * left. Each merge joins two neighbouring runs of the chain and keeps the
+ * left one first among equal elements, so the result matches the serial
+ * merge. Returns the queue holding every element.
+ */
+static queue_head_t *parallel_merge(struct list_head *chain,
+                                    int threads,
+                                    bool descend)
+{
+    sort_job_t job[MAX_SORT_THREADS], *jobs[MAX_SORT_THREADS];
+    queue_head_t *dst[MAX_SORT_THREADS], *src[MAX_SORT_THREADS];
+    queue_head_t *left;
+    int queues;
+
+    do {
+        queue_contex_t *cur;
+        int count = 0;
+        left = NULL;
+        queues = 0;
+
+        list_for_each_entry (cur, chain, chain) {
+            queue_head_t *q = to_queue(cur->q);
+            if (list_empty(&q->head))
+                continue;
+            if (queues++ % 2 == 0) {
+                left = q;
+                continue;
+            }
+
+            sort_job_t *j = &job[count];
+            INIT_LIST_HEAD(&j->head);
+            list_splice_init(&left->head, &j->head);
+            j->descend = descend;
+            j->other = &q->head;
+            dst[count] = left;
+            src[count] = q;
+            jobs[count++] = j;
+            if (count == threads) {
+                merge_jobs(jobs, dst, src, count);
+                count = 0;
+            }
+        }
+        merge_jobs(jobs, dst, src, count);
+    } while (queues > 2);
+    return left;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -410,35 +2631,174 @@ int q_merge(struct list_head *head, bool descend)
     // https://leetcode.com/problems/merge-k-sorted-lists/
     // This function's head is refer to queue_chain_t *chain in qtest.c
     // look the function call q_merge in do_merge
+    //
+    // The queues are kept in a pairing heap ordered by their front elements,
+    // so merging k queues holding N elements takes O(N log k) comparisons.
+    // The heap is threaded through the queue headers, which needs no
+    // allocation.
     queue_contex_t *cur;
-    bool (*cmp)(const char *a, const char *b) =
-        descend ? str_cmp_dsc : str_cmp_asc;
-    struct list_head *lh = NULL;
+    queue_head_t *first = NULL, *heap = NULL;
+    int rank = 0, queues = 0, total = 0;
+    LIST_HEAD(merged);
+
     list_for_each_entry (cur, head, chain) {
-        if (!lh) {
-            lh = cur->q;
-            lh->prev->next = NULL;
-        } else {
-            cur->q->prev->next = NULL;
-            lh->next = merge(lh->next, cur->q->next, cmp);
-            // In do_merge (in q_test.c), after q_merge completes, the program
-            // frees every queue except for the first one in q_chain_t.
-            // Therefore, after merging, we reinitialize the queue head to
-            // prevent the element_t nodes from being accidentally freed.
-            INIT_LIST_HEAD(cur->q);
+        queue_head_t *q = to_queue(cur->q);
+        queue_normalize(q);
+        q->mid = NULL;
+        if (!first)
+            first = q;
+        total += q->size;
+        if (!list_empty(&q->head))
+            queues++;
+        // Every element ends up in the first queue, and so do the arena
+        // chunks holding them.
+        if (q != first) {
+            first->foreign += q->foreign;
+            q->foreign = 0;
+            list_splice_init(&q->chunks, &first->chunks);
+            mirror_adopt(first, q);
+        }
+    }
+    if (!first)
+        return 0;
+
+    // Large merges of several queues go through a tree of pairwise merges
+    // spread over the sort threads instead of the heap.
+    int threads = min(sort_threads, MAX_SORT_THREADS);
+    if (threads > 1 && queues > 1 && total >= sort_parallel_size) {
+        queue_head_t *last = parallel_merge(head, threads, descend);
+        // The surviving queue holds every element now
+        if (last != first) {
+            list_splice_init(&last->head, &first->head);
+            last->size = 0;
         }
+        first->size = total;
+        mirror_refill(first, false);
+        return total;
+    }
+
+    list_for_each_entry (cur, head, chain) {
+        queue_head_t *q = to_queue(cur->q);
+        q->size = 0;
+        q->rank = rank++;
+        q->child = q->sibling = NULL;
+        if (!list_empty(&q->head))
+            heap = heap_meld(heap, q, descend);
+    }
+
+    while (heap) {
+        queue_head_t *top = heap;
+        list_move_tail(top->head.next, &merged);
+        heap = heap_pop(top, descend);
+        if (!list_empty(&top->head))
+            heap = heap_meld(heap, top, descend);
+    }
+
+    // In do_merge (in q_test.c), after q_merge completes, the program frees
+    // every queue except for the first one in q_chain_t. All of them are
+    // empty by now, so only the first one receives the merged elements.
+    list_splice(&merged, &first->head);
+    first->size = total;
+    mirror_refill(first, false);
+    return total;
+}
+
+
+/* Number of random words the shuffle draws at once */
+#define SHUFFLE_BATCH 256
+/* Average number of elements in a bucket of the blocked shuffle */
+#define SHUFFLE_BLOCK 4096
+#define SHUFFLE_MAX_BUCKETS 1024
+
+/**
+ * rand_batch_t - Random words drawn from the generator in batches
+ * @word: words drawn by the last refill
+ * @next: index of the next unused word in @word
+ */
+typedef struct {
+    uint32_t word[SHUFFLE_BATCH];
+    int next;
+} rand_batch_t;
+
+static uint32_t rand_word(rand_batch_t *r)
+{
+    if (r->next == SHUFFLE_BATCH) {
+        if (prng == 0)
+            randombytes((uint8_t *) r->word, sizeof(r->word));
+        else
+            xor_rng((uint8_t *) r->word, sizeof(r->word));
+        r->next = 0;
+    }
+    return r->word[r->next++];
+}
+
+/*
+ * Uniform random number below @range with Lemire's method: the high half of
+ * a 32x32-bit product is the result, and the rare products whose low half
+ * falls in the biased zone are drawn again.
+ */
+static uint32_t rand_below(rand_batch_t *r, uint32_t range)
+{
+    uint64_t m = (uint64_t) rand_word(r) * range;
+    if ((uint32_t) m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t) m < threshold)
+            m = (uint64_t) rand_word(r) * range;
     }
-    struct list_head *tmp = lh->next, *prev = lh;
-    while (tmp) {
-        tmp->prev = prev;
-        prev = tmp;
-        tmp = tmp->next;
+    return m >> 32;
+}
+
+/* Fisher–Yates shuffle the @n nodes of @nodes */
+static void shuffle_nodes(struct list_head **nodes, int n, rand_batch_t *r)
+{
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand_below(r, i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
     }
-    lh->prev = prev;
-    prev->next = lh;
-    return q_size(lh);
 }
 
+/*
+ * Shuffle the @sz nodes of @nodes into @out by scattering them into random
+ * buckets and shuffling every bucket on its own (the Rao-Sandelius method).
+ * The result is as uniform as a single Fisher–Yates pass, but the random
+ * swaps stay within a bucket small enough to be cached instead of spanning
+ * the whole array. Return false if an allocation fails.
+ */
+static bool shuffle_blocked(struct list_head **nodes,
+                            struct list_head **out,
+                            int sz,
+                            rand_batch_t *r)
+{
+    int buckets = min(sz / SHUFFLE_BLOCK, SHUFFLE_MAX_BUCKETS);
+    if (buckets < 2)
+        buckets = 2;
+    uint16_t *id = (uint16_t *) malloc(sizeof(uint16_t) * sz);
+    int *end = (int *) calloc(buckets + 1, sizeof(int));
+    if (!id || !end) {
+        free(id);
+        free(end);
+        return false;
+    }
+
+    /* Counting sort of the nodes by random bucket... */
+    for (int i = 0; i < sz; i++) {
+        id[i] = rand_below(r, buckets);
+        end[id[i] + 1]++;
+    }
+    for (int b = 1; b <= buckets; b++)
+        end[b] += end[b - 1];
+    for (int i = 0; i < sz; i++)
+        out[end[id[i]]++] = nodes[i];
+
+    /* ...then a Fisher–Yates pass over every bucket */
+    for (int b = 0, start = 0; b < buckets; start = end[b++])
+        shuffle_nodes(out + start, end[b] - start, r);
+    free(end);
+    free(id);
+    return true;
+}
 
 void q_shuffle(struct list_head *head)
 {
@@ -451,31 +2811,309 @@ void q_shuffle(struct list_head *head)
         (struct list_head **) malloc(sizeof(struct list_head *) * sz);
     if (!nodes)
         return;
-    struct list_head *cur = head->next;
-    for (int i = 0; i < sz; i++) {
-        nodes[i] = cur;
-        cur = cur->next;
+    if (!mirror_gather(to_queue(head), nodes)) {
+        struct list_head *cur = head->next;
+        for (int i = 0; i < sz; i++) {
+            nodes[i] = cur;
+            cur = cur->next;
+        }
     }
 
-    // Fisher–Yates Shuffle(swap pointer)
-    uint8_t buf[4] = {0};
-    for (int i = sz - 1; i > 0; i--) {
-        if (prng == 0)
-            randombytes(buf, sizeof(buf));
-        else
-            xor_rng(buf, sizeof(buf));
-        int j = *(uint32_t *) buf % (i + 1);
-        if (i != j) {
-            struct list_head *tmp = nodes[i];
-            nodes[i] = nodes[j];
-            nodes[j] = tmp;
-        }
+    rand_batch_t r = {.next = SHUFFLE_BATCH};
+    struct list_head **out = NULL;
+    if (shuffle_block && sz >= shuffle_block)
+        out = (struct list_head **) malloc(sizeof(struct list_head *) * sz);
+    if (out && shuffle_blocked(nodes, out, sz, &r)) {
+        free(nodes);
+        nodes = out;
+    } else {
+        free(out);
+        shuffle_nodes(nodes, sz, &r);
     }
 
     // Reconstruct the list from pointer array
+    to_queue(head)->mid = NULL;
     INIT_LIST_HEAD(head);
-    for (int i = 0; i < sz; i++) {
+    for (int i = 0; i < sz; i++)
         list_add_tail(nodes[i], head);
-    }
+    mirror_load(to_queue(head), nodes, sz);
     free(nodes);
-}
\ No newline at end of file
+}
+
+/**
+ * select_item_t - Element in the array q_select() searches
+ * @prefix: prefix of the element, copied so that partitioning mostly scans the
+ *          array instead of chasing pointers to elements
+ * @node: link of the element
+ */
+typedef struct {
+    uint64_t prefix;
+    struct list_head *node;
+} select_item_t;
+
+/* Whether item @a goes before item @b in @descend order */
+static inline bool select_before(const select_item_t *a,
+                                 const select_item_t *b,
+                                 bool descend)
+{
+    int c;
+    if (a->prefix != b->prefix)
+        c = a->prefix < b->prefix ? -1 : 1;
+    else
+        c = element_cmp(node_elem(a->node), node_elem(b->node));
+    return descend ? c > 0 : c < 0;
+}
+
+static inline void select_swap(select_item_t *a, select_item_t *b)
+{
+    select_item_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Sift item @i of the heap in @v[0..n) down while a child goes after it */
+static void select_sift(select_item_t *v, int i, int n, bool descend)
+{
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && select_before(&v[child], &v[child + 1], descend))
+            child++;
+        if (!select_before(&v[i], &v[child], descend))
+            break;
+        select_swap(&v[i], &v[child]);
+    }
+}
+
+/* Heapsort @v[0..n), the way out of introselect when pivots keep failing */
+static void select_heapsort(select_item_t *v, int n, bool descend)
+{
+    for (int i = n / 2 - 1; i >= 0; i--)
+        select_sift(v, i, n, descend);
+    for (int i = n - 1; i > 0; i--) {
+        select_swap(&v[0], &v[i]);
+        select_sift(v, 0, i, descend);
+    }
+}
+
+/*
+ * Rearrange @v[0..n) so that @v[k] is the item a sort in @descend order puts
+ * there, none before it goes after it and none after it goes before it.
+ *
+ * Quickselect with a median-of-three pivot narrows the range down to the side
+ * holding @k; after 2 log2(n) partitions, the range left is heapsorted.
+ */
+static void introselect(select_item_t *v, int n, int k, bool descend)
+{
+    int lo = 0, hi = n - 1;
+    int depth = 2 * (31 - __builtin_clz(n));
+    while (lo < hi) {
+        if (depth-- == 0) {
+            select_heapsort(v + lo, hi - lo + 1, descend);
+            return;
+        }
+
+        /* Order the first, middle and last items, which leaves an item on
+         * either side to stop the scans below */
+        int mid = lo + (hi - lo) / 2;
+        if (select_before(&v[mid], &v[lo], descend))
+            select_swap(&v[mid], &v[lo]);
+        if (select_before(&v[hi], &v[lo], descend))
+            select_swap(&v[hi], &v[lo]);
+        if (select_before(&v[hi], &v[mid], descend))
+            select_swap(&v[hi], &v[mid]);
+
+        select_item_t pivot = v[mid];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (select_before(&v[i], &pivot, descend))
+                i++;
+            while (select_before(&pivot, &v[j], descend))
+                j--;
+            if (i <= j)
+                select_swap(&v[i++], &v[j--]);
+        }
+
+        // Items strictly between j and i are all equal to the pivot
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+element_t *q_select(struct list_head *head, int k, bool descend)
+{
+    int sz = q_size(head);
+    if (k < 0 || k >= sz)
+        return NULL;
+
+    select_item_t *items =
+        (select_item_t *) malloc(sizeof(select_item_t) * sz);
+    if (!items)
+        return NULL;
+    /* Relinking the partial order must start from links in queue order */
+    if (select_partition)
+        queue_normalize(to_queue(head));
+    element_t *cur;
+    int n = 0;
+    list_for_each_entry (cur, head, list) {
+        items[n].prefix = cur->prefix;
+        items[n++].node = &cur->list;
+    }
+
+    introselect(items, sz, k, descend);
+    element_t *found = node_elem(items[k].node);
+
+    if (select_partition) {
+        /* Each link fits in the first half of its own item, so the links can
+         * be packed in place for mirror_load() */
+        struct list_head **nodes = (struct list_head **) items;
+        to_queue(head)->mid = NULL;
+        INIT_LIST_HEAD(head);
+        for (int i = 0; i < sz; i++) {
+            nodes[i] = items[i].node;
+            list_add_tail(nodes[i], head);
+        }
+        mirror_load(to_queue(head), nodes, sz);
+    }
+    free(items);
+    return found;
+}
+
+/* Element a link of the pairing heap of a priority queue points to */
+static inline element_t *pq_elem(struct list_head *link)
+{
+    return link ? list_entry(link, element_t, list) : NULL;
+}
+
+/* Whether element @a comes out of a priority queue before element @b */
+static inline bool pq_before(const element_t *a,
+                             const element_t *b,
+                             bool descend)
+{
+    int c = element_cmp(a, b);
+    return descend ? c > 0 : c < 0;
+}
+
+/* Meld two pairing heaps of elements and return the new root */
+static element_t *pq_meld(element_t *a, element_t *b, bool descend)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (pq_before(b, a, descend)) {
+        element_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->list.next = a->list.prev;
+    a->list.prev = &b->list;
+    return a;
+}
+
+/* Meld the children of a popped root in two passes, as heap_pop() does */
+static element_t *pq_meld_children(element_t *list, bool descend)
+{
+    element_t *pairs = NULL;
+    while (list) {
+        element_t *a = list, *b = pq_elem(a->list.next);
+        if (!b) {
+            a->list.next = pairs ? &pairs->list : NULL;
+            pairs = a;
+            break;
+        }
+        list = pq_elem(b->list.next);
+        a->list.next = b->list.next = NULL;
+        a = pq_meld(a, b, descend);
+        a->list.next = pairs ? &pairs->list : NULL;
+        pairs = a;
+    }
+
+    element_t *heap = NULL;
+    while (pairs) {
+        element_t *next = pq_elem(pairs->list.next);
+        pairs->list.next = NULL;
+        heap = pq_meld(heap, pairs, descend);
+        pairs = next;
+    }
+    return heap;
+}
+
+/* Create an empty priority queue */
+pqueue_t *pq_new(bool descend)
+{
+    pqueue_t *pq = (pqueue_t *) malloc(sizeof(pqueue_t));
+    if (!pq)
+        return NULL;
+    pq->root = NULL;
+    pq->size = 0;
+    pq->descend = descend;
+    return pq;
+}
+
+/* Free all storage used by priority queue */
+void pq_free(pqueue_t *pq)
+{
+    if (!pq)
+        return;
+
+    /* Seen as a binary tree with the first child on the left and the next
+     * sibling on the right, the heap is freed by rotating left subtrees to
+     * the right until the node at hand has none, without any stack.
+     */
+    element_t *e = pq->root;
+    while (e) {
+        element_t *child = pq_elem(e->list.prev);
+        if (child) {
+            e->list.prev = child->list.next;
+            child->list.next = &e->list;
+            e = child;
+        } else {
+            element_t *next = pq_elem(e->list.next);
+            q_release_element(e);
+            e = next;
+        }
+    }
+    free(pq);
+}
+
+/* Insert an element in priority queue */
+bool pq_push(pqueue_t *pq, char *s)
+{
+    if (!pq || !s)
+        return false;
+
+    element_t *e = element_new(s);
+    if (!e)
+        return false;
+    e->list.prev = e->list.next = NULL;
+    pq->root = pq_meld(pq->root, e, pq->descend);
+    pq->size++;
+    return true;
+}
+
+/* Get the element priority queue would pop next */
+element_t *pq_peek(pqueue_t *pq)
+{
+    return pq ? pq->root : NULL;
+}
+
+/* Remove the smallest, or largest, element from priority queue */
+element_t *pq_pop(pqueue_t *pq, char *sp, size_t bufsize)
+{
+    if (!pq || !pq->root)
+        return NULL;
+
+    element_t *e = pq->root;
+    pq->root = pq_meld_children(pq_elem(e->list.prev), pq->descend);
+    pq->size--;
+    INIT_LIST_HEAD(&e->list);
+    if (sp) {
+        size_t sz = min(strlen(e->value), bufsize - 1);
+        memcpy(sp, e->value, sz);
+        sp[sz] = '\0';
+    }
+    return e;
+}
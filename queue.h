@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
@@ -17,14 +18,61 @@
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @prefix: first eight bytes of the string as a big-endian integer, padded
+ *          with zeros, so most comparisons never have to read @value
+ * @slab: slab the element was carved out of, or NULL if it has a block of its
+ *        own
+ * @data: storage for the string when it shares the allocation of the element
+ *
+ * Elements created by the queue operations keep their string in @data, so a
+ * single block holds both and @value points into it. If @value points
+ * anywhere else, it needs to be explicitly allocated and freed.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t prefix;
+    struct element_slab *slab;
+    char data[];
 } element_t;
 
+/**
+ * element_prefix() - Compute the prefix an element holding a string stores
+ * @s: the string
+ *
+ * Return: the first eight bytes of @s as a big-endian integer, padded with
+ * zeros
+ */
+static inline uint64_t element_prefix(const char *s)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(key); i++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char) *s++;
+    }
+    return key;
+}
+
+/**
+ * element_slab_t - Block shared by several elements
+ * @refs: number of references keeping the block allocated
+ * @arena: whether the block is a chunk of the arena of a queue
+ *
+ * The bulk insertions carve every element of a batch, strings included, out
+ * of one slab, which holds a reference for each element and is freed together
+ * with the last of them.
+ *
+ * Queues created in arena mode carve their elements out of chunks they own
+ * instead. A chunk holds one reference for its queue and one for each of its
+ * elements removed from the queue and not released yet, so freeing the queue
+ * drops whole chunks without visiting the elements still linked to it.
+ */
+typedef struct element_slab {
+    size_t refs;
+    bool arena;
+} element_slab_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -54,6 +102,20 @@ struct list_head *q_new();
  */
 void q_free(struct list_head *head);
 
+/**
+ * q_flush() - Release the elements deleted from queue but not released yet
+ * @head: header of queue
+ *
+ * q_delete_mid(), q_delete_dup(), q_ascend() and q_descend() move the
+ * elements they delete to a graveyard of the queue. They release it in
+ * batches of a few dozen elements while they run, and release what is left
+ * before returning, unless asked to keep the elements there until this
+ * function or q_free() is called.
+ *
+ * No effect if queue is NULL.
+ */
+void q_flush(struct list_head *head);
+
 /**
  * q_insert_head() - Insert an element in the head
  * @head: header of queue
@@ -78,6 +140,34 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert a batch of elements in the head
+ * @head: header of queue
+ * @strs: strings would be inserted
+ * @n: number of strings in @strs
+ *
+ * Equivalent to calling q_insert_head() for each string of @strs in order, so
+ * the last of them ends up first, except that all the elements are allocated
+ * together in one slab and linked to the queue with a single splice.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_bulk(struct list_head *head, char **strs, size_t n);
+
+/**
+ * q_insert_tail_bulk() - Insert a batch of elements at the tail
+ * @head: header of queue
+ * @strs: strings would be inserted
+ * @n: number of strings in @strs
+ *
+ * Equivalent to calling q_insert_tail() for each string of @strs in order,
+ * except that all the elements are allocated together in one slab and linked
+ * to the queue with a single splice.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **strs, size_t n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,6 +198,57 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_head_n() - Remove a batch of elements from head of queue
+ * @head: header of queue
+ * @list: list the removed elements are appended to, in queue order
+ * @n: number of elements to remove
+ *
+ * Removes the first n elements, or all of them if the queue is shorter, the
+ * way n calls to q_remove_head() would, without copying any string. The
+ * batch is detached with a single list_cut_position(), so the only walk is
+ * the one locating the cut, from whichever end of the queue is closer.
+ *
+ * The elements are unlinked, not freed; the caller releases them.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int n);
+
+/**
+ * q_remove_tail_n() - Remove a batch of elements from tail of queue
+ * @head: header of queue
+ * @list: list the removed elements are appended to, in queue order
+ * @n: number of elements to remove
+ *
+ * Same as q_remove_head_n() for the last n elements of the queue.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int n);
+
+/**
+ * q_pool_put() - Give an element back to the node pool
+ * @e: element holding its string in @data and not carved out of a slab
+ *
+ * Released elements are kept on free lists, one per size class, so that
+ * the next insertions can reuse them instead of calling malloc. An element
+ * whose string is too long for any class, or which would take the pool over
+ * its cap, is freed right away.
+ *
+ * This function is intended for internal use only.
+ */
+void q_pool_put(element_t *e);
+
+/**
+ * q_pool_trim() - Free the elements kept by the node pool
+ * @keep: number of elements the pool may keep
+ *
+ * The pooled elements stay allocated in the harness, so callers checking for
+ * leaks have to trim the pool to zero first.
+ */
+void q_pool_trim(int keep);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
@@ -116,8 +257,13 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
-    test_free(e);
+    if (e->value != e->data) {
+        test_free(e->value);
+        test_free(e);
+    } else if (!e->slab)
+        q_pool_put(e);
+    else if (!--e->slab->refs)
+        test_free(e->slab);
 }
 
 /**
@@ -175,6 +321,19 @@ void q_swap(struct list_head *head);
  */
 void q_reverse(struct list_head *head);
 
+/**
+ * q_reversed() - Tell whether the links of queue run backwards
+ * @head: header of queue
+ *
+ * With the lazy reverse enabled, q_reverse() only flips a direction flag on
+ * the queue, which then runs from @head->prev to @head->next. Code walking
+ * the links of the queue by itself must follow that direction.
+ *
+ * Return: true if the queue starts at @head->prev, false otherwise or if
+ * queue is NULL.
+ */
+bool q_reversed(struct list_head *head);
+
 /**
  * q_reverseK() - Given the head of a linked list, reverse the nodes of the list
  * k at a time.
@@ -190,6 +349,13 @@ void q_reverse(struct list_head *head);
  */
 void q_reverseK(struct list_head *head, int k);
 
+/* Sorting algorithms q_sort() picks from with the 'sortalgo' option of qtest */
+enum {
+    SORT_MERGE,
+    SORT_TIM,
+    SORT_RADIX,
+};
+
 /**
  * q_sort() - Sort elements of queue in ascending/descending order
  * @head: header of queue
@@ -250,4 +416,85 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/**
+ * q_select() - Find the element at a given position of the sorted queue
+ * @head: header of queue
+ * @k: 0-based position, (q_size() - 1) / 2 for the lower median
+ * @descend: whether positions count in descending order
+ *
+ * Returns the element q_sort() would leave at position @k without sorting:
+ * introselect over an array of the elements takes expected O(n) time, and
+ * O(n log n) at worst. The queue is left unchanged, unless asked to keep the
+ * partial order the search leaves, in which case the elements are relinked
+ * so that none before position @k goes after the found one in @descend
+ * order, and none after it goes before it.
+ *
+ * Return: the pointer to element, %NULL if queue is NULL, @k is out of range
+ * or allocation failed.
+ */
+element_t *q_select(struct list_head *head, int k, bool descend);
+
+/**
+ * pqueue_t - Priority queue of elements ordered by their strings
+ * @root: element whose string comes out first, NULL if the queue is empty
+ * @size: number of elements in the queue
+ * @descend: whether the largest string comes out first instead of the
+ *           smallest
+ *
+ * The elements form a pairing heap threaded through their list members, the
+ * way q_merge() orders queues: list.prev points to the first child of an
+ * element and list.next to its next sibling, or NULL.
+ */
+typedef struct {
+    element_t *root;
+    int size;
+    bool descend;
+} pqueue_t;
+
+/**
+ * pq_new() - Create an empty priority queue
+ * @descend: whether to pop the largest string first instead of the smallest
+ *
+ * Return: NULL for allocation failed
+ */
+pqueue_t *pq_new(bool descend);
+
+/**
+ * pq_free() - Free all storage used by priority queue, no effect if it is NULL
+ * @pq: the priority queue
+ */
+void pq_free(pqueue_t *pq);
+
+/**
+ * pq_push() - Insert an element in priority queue
+ * @pq: the priority queue
+ * @s: string would be inserted
+ *
+ * Takes O(1) time; the order is settled by the next pq_pop().
+ *
+ * Return: true for success, false for allocation failed or @pq is NULL
+ */
+bool pq_push(pqueue_t *pq, char *s);
+
+/**
+ * pq_peek() - Get the element priority queue would pop next
+ * @pq: the priority queue
+ *
+ * Return: the pointer to element, %NULL if @pq is NULL or empty.
+ */
+element_t *pq_peek(pqueue_t *pq);
+
+/**
+ * pq_pop() - Remove the smallest, or largest, element from priority queue
+ * @pq: the priority queue
+ * @sp: output buffer where the removed string is copied
+ * @bufsize: size of the string
+ *
+ * Copies the string as q_remove_head() does and, like it, only unlinks the
+ * element. Takes O(log n) amortized time.
+ *
+ * Return: the pointer to element, %NULL if @pq is NULL or empty.
+ */
+element_t *pq_pop(pqueue_t *pq, char *sp, size_t bufsize);
+
 #endif /* LAB0_QUEUE_H */
@@ -0,0 +1,15 @@
+# Time insertion, traversal, sorting and removal on a large queue.
+# 'make bench' runs it against the plain, the unrolled and the ring queue.
+option fail 0
+option malloc 0
+new
+time ih dolphin 500000
+time it gerbil 500000
+time ih RAND 100000
+time sort
+time shuffle
+time reverse
+time swap
+time rhn 300000
+time rtn 300000
+time free
@@ -0,0 +1,4 @@
+# Compare the throughput of the queues shared between threads: one mutex,
+# separate head and tail locks, and lock-free, with 1 to 8 producer and
+# consumer threads each.
+cqbench 8 400000
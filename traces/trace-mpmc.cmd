@@ -0,0 +1,7 @@
+# Pass items between producer and consumer threads through the lock-free
+# queue, checking that every item arrives exactly once.
+mpmc 1 1 100000
+mpmc 4 1 50000
+mpmc 1 4 200000
+mpmc 4 4 50000
+mpmc 16 16 10000
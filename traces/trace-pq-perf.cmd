@@ -0,0 +1,14 @@
+# Take the 1000 smallest of 300000 random strings, first by sorting the queue and
+# removing from its head, then through the priority queue, which also pops
+# all of them in order to compare with the full sort.
+option fail 0
+option malloc 0
+new
+time ih RAND 300000
+time sort
+time rhn 1000
+free
+time pq_push RAND 300000
+time pq_pop 1000
+time pq_pop 299000
+pq_free
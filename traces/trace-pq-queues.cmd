@@ -0,0 +1,20 @@
+# Free every queue while the priority queue still holds elements, then use it
+# again with and without queues around. Changing descend meanwhile does not
+# change the order it pops in.
+pq_push dolphin
+pq_push RAND 5
+new
+ih bear
+it gerbil 3
+free
+pq_push alpha
+pq_pop
+pq_peek
+new
+ih RAND 4
+option descend 1
+pq_push zebra 2
+free
+pq_pop 7
+pq_free
+option descend 0
@@ -0,0 +1,21 @@
+# Find the median, then the largest, of 1000000 random strings through select,
+# and compare with sorting the queue and walking to either. The radix sort is
+# used, as sorting that many strings with the merge sort exceeds the time
+# limit.
+option fail 0
+option malloc 0
+option sortalgo 2
+new
+time ih RAND 1000000
+time select
+option descend 1
+time select 0
+option descend 0
+time sort
+time nth
+time nth 999999
+# Keep the queue partitioned around the median found on the shuffled queue
+shuffle
+option selectpart 1
+time select
+free